@@ -0,0 +1,182 @@
+/*  buffer-pool.c
+
+    Copyright 2026 spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "buffer-pool.h"
+
+/* Size classes range from 64 bytes to BUFFER_POOL_MAX_SIZE */
+#define MIN_SHIFT 6
+#define MAX_SHIFT 16
+#define N_CLASSES (MAX_SHIFT - MIN_SHIFT + 1)
+
+/* Maximum amount of memory kept for reuse per size class */
+#define CLASS_CACHE_SIZE (256 * 1024)
+
+G_STATIC_ASSERT(BUFFER_POOL_MAX_SIZE == 1 << MAX_SHIFT);
+
+/* Precedes every buffer handed out by the pool */
+typedef struct {
+    BufferPool *pool;
+    /* size of the size class, or the mapped size of large buffers */
+    gsize       size;
+} BufferHeader;
+
+G_STATIC_ASSERT(sizeof(BufferHeader) % 8 == 0);
+
+struct BufferPool {
+    gint            ref_count;
+    /* protects the free lists and the stats */
+    GMutex          lock;
+    /* released buffers are linked through their first bytes */
+    gpointer        free_list[N_CLASSES];
+    guint           n_free[N_CLASSES];
+    BufferPoolStats stats;
+};
+
+BufferPool *buffer_pool_new(void)
+{
+    BufferPool *pool = g_new0(BufferPool, 1);
+    pool->ref_count = 1;
+    g_mutex_init(&pool->lock);
+    return pool;
+}
+
+BufferPool *buffer_pool_ref(BufferPool *pool)
+{
+    g_atomic_int_inc(&pool->ref_count);
+    return pool;
+}
+
+void buffer_pool_unref(BufferPool *pool)
+{
+    gpointer buf;
+    guint i;
+
+    if (!g_atomic_int_dec_and_test(&pool->ref_count)) {
+        return;
+    }
+
+    for (i = 0; i < N_CLASSES; i++) {
+        while ((buf = pool->free_list[i])) {
+            pool->free_list[i] = *(gpointer *) buf;
+            g_free((BufferHeader *) buf - 1);
+        }
+    }
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+static guint size_class(gsize size)
+{
+    guint shift = size > 1 ? g_bit_storage(size - 1) : 0;
+    return MAX(shift, MIN_SHIFT) - MIN_SHIFT;
+}
+
+gpointer buffer_pool_alloc(BufferPool *pool, gsize size)
+{
+    BufferHeader *header;
+    gpointer buf;
+    gsize page_size;
+    guint cls;
+
+    if (size > BUFFER_POOL_MAX_SIZE) {
+        page_size = sysconf(_SC_PAGESIZE);
+        size = (sizeof(BufferHeader) + size + page_size - 1) & ~(page_size - 1);
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (header == MAP_FAILED) {
+            g_error("buffer-pool: failed to map %" G_GSIZE_FORMAT " bytes: %s",
+                    size, g_strerror(errno));
+        }
+        g_mutex_lock(&pool->lock);
+        pool->stats.large++;
+        g_mutex_unlock(&pool->lock);
+    } else {
+        cls = size_class(size);
+        g_mutex_lock(&pool->lock);
+        buf = pool->free_list[cls];
+        if (buf) {
+            pool->free_list[cls] = *(gpointer *) buf;
+            pool->n_free[cls]--;
+            pool->stats.hits++;
+        } else {
+            pool->stats.misses++;
+        }
+        g_mutex_unlock(&pool->lock);
+
+        if (buf) {
+            header = (BufferHeader *) buf - 1;
+        } else {
+            size = 1 << (cls + MIN_SHIFT);
+            header = g_malloc(sizeof(BufferHeader) + size);
+        }
+    }
+
+    header->pool = buffer_pool_ref(pool);
+    header->size = size;
+    return header + 1;
+}
+
+void buffer_pool_release(gpointer buf)
+{
+    BufferHeader *header;
+    BufferPool *pool;
+    guint cls;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    header = (BufferHeader *) buf - 1;
+    pool = header->pool;
+
+    if (header->size > BUFFER_POOL_MAX_SIZE) {
+        munmap(header, header->size);
+    } else {
+        cls = size_class(header->size);
+        g_mutex_lock(&pool->lock);
+        if (pool->n_free[cls] < CLASS_CACHE_SIZE / header->size) {
+            *(gpointer *) buf = pool->free_list[cls];
+            pool->free_list[cls] = buf;
+            pool->n_free[cls]++;
+            buf = NULL;
+        }
+        g_mutex_unlock(&pool->lock);
+
+        if (buf) {
+            g_free(header);
+        }
+    }
+
+    buffer_pool_unref(pool);
+}
+
+GBytes *buffer_pool_bytes_new_take(gpointer buf, gsize size)
+{
+    return g_bytes_new_with_free_func(buf, size, buffer_pool_release, buf);
+}
+
+void buffer_pool_get_stats(BufferPool *pool, BufferPoolStats *stats)
+{
+    g_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    g_mutex_unlock(&pool->lock);
+}
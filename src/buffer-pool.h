@@ -0,0 +1,64 @@
+/*  buffer-pool.h
+
+    Copyright 2026 spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __BUFFER_POOL_H
+#define __BUFFER_POOL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Pool of message buffers.
+ *
+ * Small buffers are rounded up to a power of two and recycled,
+ * buffers larger than BUFFER_POOL_MAX_SIZE are mmap()-ed and returned
+ * to the OS as soon as they're released.
+ *
+ * Buffers can be allocated and released from any thread. */
+typedef struct BufferPool BufferPool;
+
+#define BUFFER_POOL_MAX_SIZE (64 * 1024)
+
+typedef struct {
+    guint64 hits;    /* allocations served from the pool */
+    guint64 misses;  /* pooled allocations that had to hit the allocator */
+    guint64 large;   /* allocations too large to be pooled */
+} BufferPoolStats;
+
+BufferPool *buffer_pool_new(void);
+
+/* Each buffer holds a reference to its pool,
+ * so that it can outlive the pool's owner. */
+BufferPool *buffer_pool_ref(BufferPool *pool);
+void buffer_pool_unref(BufferPool *pool);
+
+/* Returns a buffer of at least @size bytes, aligned to 8 bytes. */
+gpointer buffer_pool_alloc(BufferPool *pool, gsize size);
+
+/* Returns @buf back to the pool it was allocated from, NULL is ignored. */
+void buffer_pool_release(gpointer buf);
+
+/* Wraps @size bytes of pooled @buf in GBytes,
+ * the buffer is released once the GBytes is freed. */
+GBytes *buffer_pool_bytes_new_take(gpointer buf, gsize size);
+
+void buffer_pool_get_stats(BufferPool *pool, BufferPoolStats *stats);
+
+G_END_DECLS
+
+#endif
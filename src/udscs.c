@@ -27,6 +27,8 @@
 #include <glib-unix.h>
 #include <gio/gunixsocketaddress.h>
 #include "udscs.h"
+#include "vdagent-probes.h"
+#include "vdagentd-proto.h"
 #include "vdagentd-proto-strings.h"
 #include "vdagent-connection.h"
 
@@ -40,10 +42,37 @@ struct _UdscsConnection {
     VDAgentConnection parent_instance;
     int debug;
     udscs_read_callback read_callback;
+
+    /* Message started by udscs_write_start(), its payload is held in
+     * write_parts until it's complete */
+    struct udscs_message_header write_header;
+    uint32_t write_left;
+    GPtrArray *write_parts;
+
+    /* Link in the connection list of the server */
+    GList *server_link;
 };
 
 G_DEFINE_TYPE(UdscsConnection, udscs_connection, VDAGENT_TYPE_CONNECTION)
 
+/* Messages received and sent by all the connections, per type */
+static VDAgentMessageStats messages_received[VDAGENTD_NO_MESSAGES];
+static VDAgentMessageStats messages_sent[VDAGENTD_NO_MESSAGES];
+
+static void count_message(VDAgentMessageStats         *stats,
+                          struct udscs_message_header *header)
+{
+    if (header->type < VDAGENTD_NO_MESSAGES) {
+        stats[header->type].messages++;
+        stats[header->type].bytes += header->size;
+    }
+}
+
+const VDAgentMessageStats *udscs_get_message_stats(gboolean sent)
+{
+    return sent ? messages_sent : messages_received;
+}
+
 static void debug_print_message_header(UdscsConnection             *conn,
                                        struct udscs_message_header *header,
                                        const gchar                 *direction)
@@ -63,7 +92,10 @@ static void debug_print_message_header(UdscsConnection             *conn,
 static gsize conn_handle_header(VDAgentConnection *conn,
                                 gpointer           header_buf)
 {
-    return ((struct udscs_message_header *)header_buf)->size;
+    struct udscs_message_header *header = header_buf;
+
+    VDAGENT_PROBE(udscs_message_received, conn, header->type, header->size);
+    return header->size;
 }
 
 static void conn_handle_message(VDAgentConnection *conn,
@@ -74,8 +106,12 @@ static void conn_handle_message(VDAgentConnection *conn,
     struct udscs_message_header *header = header_buf;
 
     debug_print_message_header(self, header, "received");
+    count_message(messages_received, header);
 
+    VDAGENT_PROBE(udscs_message_dispatch, conn, header->type,
+                  header->arg1, header->arg2, header->size);
     self->read_callback(self, header, data);
+    VDAGENT_PROBE(udscs_message_done, conn, header->type);
 }
 
 static void udscs_connection_init(UdscsConnection *self)
@@ -89,6 +125,7 @@ static void udscs_connection_finalize(GObject *obj)
     if (self->debug) {
         syslog(LOG_DEBUG, "%p disconnected", self);
     }
+    g_clear_pointer(&self->write_parts, g_ptr_array_unref);
 
     G_OBJECT_CLASS(udscs_connection_parent_class)->finalize(obj);
 }
@@ -134,12 +171,32 @@ UdscsConnection *udscs_connect(const char *socketname,
     return conn;
 }
 
+/* Clipboard and file transfer data are queued with a lower priority,
+ * so that they don't delay other messages. Clipboard control messages
+ * and file transfer statuses share the class of the data, as they must
+ * not overtake it: a cancelled transfer would get data after its status. */
+static VDAgentConnectionPriority message_priority(uint32_t type)
+{
+    switch (type) {
+    case VDAGENTD_CLIPBOARD_GRAB:
+    case VDAGENTD_CLIPBOARD_REQUEST:
+    case VDAGENTD_CLIPBOARD_DATA:
+    case VDAGENTD_CLIPBOARD_RELEASE:
+    case VDAGENTD_FILE_XFER_STATUS:
+    case VDAGENTD_FILE_XFER_DATA:
+        return VDAGENT_CONNECTION_PRIORITY_BULK;
+    default:
+        return VDAGENT_CONNECTION_PRIORITY_CONTROL;
+    }
+}
+
 void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
     uint32_t arg2, const uint8_t *data, uint32_t size)
 {
     gpointer buf;
     guint buf_size;
     struct udscs_message_header header;
+    GBytes *bytes;
 
     buf_size = sizeof(header) + size;
     buf = g_malloc(buf_size);
@@ -153,8 +210,124 @@ void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
     memcpy(buf + sizeof(header), data, size);
 
     debug_print_message_header(conn, &header, "sent");
+    count_message(messages_sent, &header);
+    VDAGENT_PROBE(udscs_message_send, conn, type, arg1, arg2, header.size);
+
+    bytes = g_bytes_new_take(buf, buf_size);
+    vdagent_connection_write_message(VDAGENT_CONNECTION(conn),
+                                     message_priority(type), &bytes, 1);
+    g_bytes_unref(bytes);
+}
+
+void udscs_write_bytes(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, GBytes *data)
+{
+    struct udscs_message_header header;
+    gsize size = data ? g_bytes_get_size(data) : 0;
+    GBytes *parts[2];
+
+    g_return_if_fail(size <= G_MAXUINT32);
+
+    header.type = type;
+    header.arg1 = arg1;
+    header.arg2 = arg2;
+    header.size = size;
+
+    debug_print_message_header(conn, &header, "sent");
+    count_message(messages_sent, &header);
+    VDAGENT_PROBE(udscs_message_send, conn, type, arg1, arg2, header.size);
+
+    parts[0] = g_bytes_new(&header, sizeof(header));
+    parts[1] = data;
+    vdagent_connection_write_message(VDAGENT_CONNECTION(conn),
+                                     message_priority(type),
+                                     parts, size > 0 ? 2 : 1);
+    g_bytes_unref(parts[0]);
+}
+
+void udscs_write_start(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, uint32_t size)
+{
+    g_return_if_fail(conn->write_parts == NULL);
 
-    vdagent_connection_write(VDAGENT_CONNECTION(conn), buf, buf_size);
+    if (size == 0) {
+        udscs_write_bytes(conn, type, arg1, arg2, NULL);
+        return;
+    }
+
+    conn->write_header.type = type;
+    conn->write_header.arg1 = arg1;
+    conn->write_header.arg2 = arg2;
+    conn->write_header.size = size;
+    conn->write_left = size;
+    /* the header goes first, it's added once the payload is complete */
+    conn->write_parts = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+}
+
+void udscs_write_append(UdscsConnection *conn, const uint8_t *data,
+    uint32_t size)
+{
+    BufferPool *pool;
+    gpointer buf;
+    GBytes *bytes;
+
+    g_return_if_fail(size <= conn->write_left);
+
+    if (size == 0) {
+        return;
+    }
+
+    pool = vdagent_connection_get_buffer_pool(VDAGENT_CONNECTION(conn));
+    buf = buffer_pool_alloc(pool, size);
+    memcpy(buf, data, size);
+
+    bytes = buffer_pool_bytes_new_take(buf, size);
+    udscs_write_append_bytes(conn, bytes);
+    g_bytes_unref(bytes);
+}
+
+void udscs_write_append_bytes(UdscsConnection *conn, GBytes *data)
+{
+    struct udscs_message_header *header = &conn->write_header;
+    gsize size = g_bytes_get_size(data);
+    GPtrArray *parts;
+
+    g_return_if_fail(conn->write_parts != NULL);
+    g_return_if_fail(size <= conn->write_left);
+
+    if (size == 0) {
+        return;
+    }
+
+    g_ptr_array_add(conn->write_parts, g_bytes_ref(data));
+    conn->write_left -= size;
+    if (conn->write_left > 0) {
+        return;
+    }
+
+    debug_print_message_header(conn, header, "sent");
+    count_message(messages_sent, header);
+    VDAGENT_PROBE(udscs_message_send, conn, header->type, header->arg1,
+                  header->arg2, header->size);
+
+    parts = g_steal_pointer(&conn->write_parts);
+    g_ptr_array_insert(parts, 0, g_bytes_new(header, sizeof(*header)));
+    vdagent_connection_write_message(VDAGENT_CONNECTION(conn),
+                                     message_priority(header->type),
+                                     (GBytes **)parts->pdata, parts->len);
+    g_ptr_array_unref(parts);
+}
+
+void udscs_write_end(UdscsConnection *conn)
+{
+    if (conn->write_parts == NULL) {
+        return;
+    }
+
+    syslog(LOG_WARNING, "%p message (type %u) truncated, %u bytes missing, "
+           "dropping it", conn, conn->write_header.type, conn->write_left);
+    g_clear_pointer(&conn->write_parts, g_ptr_array_unref);
+    conn->write_left = 0;
 }
 
 #ifndef UDSCS_NO_SERVER
@@ -163,7 +336,7 @@ void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
 
 struct udscs_server {
     GSocketService *service;
-    GList *connections;
+    GQueue connections;
 
     int debug;
     udscs_connect_callback connect_callback;
@@ -189,6 +362,7 @@ struct udscs_server *udscs_server_new(
     server->connect_callback = connect_callback;
     server->read_callback = read_callback;
     server->error_cb = error_cb;
+    g_queue_init(&server->connections);
     server->service = g_socket_service_new();
     g_socket_service_stop(server->service);
 
@@ -236,7 +410,10 @@ void udscs_server_start(struct udscs_server *server)
 void udscs_server_destroy_connection(struct udscs_server *server,
                                      UdscsConnection     *conn)
 {
-    server->connections = g_list_remove(server->connections, conn);
+    if (conn->server_link) {
+        g_queue_delete_link(&server->connections, conn->server_link);
+        conn->server_link = NULL;
+    }
     vdagent_connection_destroy(conn);
 }
 
@@ -245,7 +422,7 @@ void udscs_destroy_server(struct udscs_server *server)
     if (!server)
         return;
 
-    g_list_free_full(server->connections, vdagent_connection_destroy);
+    g_queue_clear_full(&server->connections, vdagent_connection_destroy);
     g_object_unref(server->service);
     g_free(server);
 }
@@ -259,7 +436,7 @@ static gboolean udscs_server_accept_cb(GSocketService    *service,
     UdscsConnection *new_conn;
 
     /* prevents DoS having too many agents attached */
-    if (g_list_length(server->connections) >= MAX_CONNECTED_AGENTS) {
+    if (g_queue_get_length(&server->connections) >= MAX_CONNECTED_AGENTS) {
         syslog(LOG_ERR, "Too many agents connected");
         return TRUE;
     }
@@ -274,7 +451,8 @@ static gboolean udscs_server_accept_cb(GSocketService    *service,
                              sizeof(struct udscs_message_header),
                              server->error_cb);
 
-    server->connections = g_list_prepend(server->connections, new_conn);
+    g_queue_push_head(&server->connections, new_conn);
+    new_conn->server_link = server->connections.head;
 
     if (server->debug)
         syslog(LOG_DEBUG, "new client accepted: %p", new_conn);
@@ -290,9 +468,14 @@ void udscs_server_write_all(struct udscs_server *server,
         const uint8_t *data, uint32_t size)
 {
     GList *l;
-    for (l = server->connections; l; l = l->next) {
-        udscs_write(UDSCS_CONNECTION(l->data), type, arg1, arg2, data, size);
+    GBytes *bytes;
+
+    /* all the clients share the same copy of the payload */
+    bytes = g_bytes_new(data, size);
+    for (l = server->connections.head; l; l = l->next) {
+        udscs_write_bytes(UDSCS_CONNECTION(l->data), type, arg1, arg2, bytes);
     }
+    g_bytes_unref(bytes);
 }
 
 int udscs_server_for_all_clients(struct udscs_server *server,
@@ -304,7 +487,7 @@ int udscs_server_for_all_clients(struct udscs_server *server,
     if (!server)
         return 0;
 
-    l = server->connections;
+    l = server->connections.head;
     while (l) {
         next = l->next;
         r += func(l->data, priv);
@@ -67,6 +67,42 @@ UdscsConnection *udscs_connect(const char *socketname,
 void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
         uint32_t arg2, const uint8_t *data, uint32_t size);
 
+/* Like udscs_write, but the payload is not copied: the message header is
+ * queued in its own buffer followed by a reference to @data.
+ * Borrowed buffers can be passed using g_bytes_new_with_free_func().
+ * @data may be NULL for messages without payload.
+ */
+void udscs_write_bytes(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+        uint32_t arg2, GBytes *data);
+
+/* Start a message whose payload of @size bytes is passed in pieces
+ * to udscs_write_append(). The pieces are held, without copying them
+ * when appended with udscs_write_append_bytes(), and the message is only
+ * queued once all of @size is appended: a message still being received
+ * from a slow source doesn't hold back the other messages sent through
+ * conn meanwhile, which are queued ahead of it.
+ * Only one message may be started at a time on conn.
+ */
+void udscs_write_start(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+        uint32_t arg2, uint32_t size);
+
+void udscs_write_append(UdscsConnection *conn, const uint8_t *data,
+        uint32_t size);
+
+/* Like udscs_write_append(), but takes a reference to @data
+ * instead of copying it. */
+void udscs_write_append_bytes(UdscsConnection *conn, GBytes *data);
+
+/* Finish the message started with udscs_write_start(). If not all of its
+ * payload was appended, the message is dropped, it's never sent truncated.
+ */
+void udscs_write_end(UdscsConnection *conn);
+
+/* Returns the number of messages and bytes either sent or received by all
+ * the connections of the process, indexed by the VDAGENTD_* message type,
+ * with VDAGENTD_NO_MESSAGES entries. */
+const VDAgentMessageStats *udscs_get_message_stats(gboolean sent);
+
 #ifndef UDSCS_NO_SERVER
 
 /* ---------- Server-side API ---------- */
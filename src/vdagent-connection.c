@@ -16,39 +16,230 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <config.h>
+
+#include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <glib/gstdio.h>
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
 #include <gio/gunixsocketaddress.h>
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
 
 #include "vdagent-connection.h"
+#include "buffer-pool.h"
+
+/* Maximum number of queued buffers flushed with a single syscall */
+#define MAX_WRITE_IOV 64
+
+/* Size of the buffer incoming messages are read into */
+#define READ_BUF_SIZE (32 * 1024)
+
+/* Alignment of message bodies passed to handle_message() */
+#define DATA_ALIGNMENT 8
+
+/* Bounds of the interval, in ms, in which the FD is checked
+ * while waiting for the other side to open the connection */
+#define OPENING_MIN_DELAY 2
+#define OPENING_MAX_DELAY 100
+
+#ifdef HAVE_LIBURING
+/* Size of the submission queue, fits a read, a write and their cancellation */
+#define URING_ENTRIES 4
+
+/* io_uring based I/O: a read is kept posted at all times and completions
+ * are picked up in the main loop through the ring's eventfd */
+typedef struct {
+    struct io_uring ring;
+    gint            event_fd;
+    GSource        *source;
+
+    /* also set while polling after a read returned EAGAIN */
+    gboolean        reading;
+    guint           read_op;
+    gboolean        read_stopped;
+    struct iovec    read_iov;
+    /* result of a read which completed while flushing */
+    gboolean        read_res_pending;
+    gint            read_res;
+
+    gboolean        writing;
+    guint           write_op;
+    gboolean        write_stopped;
+    struct iovec    write_iov[MAX_WRITE_IOV];
+    gint8           write_prios[MAX_WRITE_IOV];
+    gint            n_write_iov;
+    struct msghdr   write_msg;
+} Uring;
+#endif
+
+/* Read buffer, shared with the slices of it handed out
+ * by vdagent_connection_get_message_bytes(), these may be released
+ * from another thread */
+typedef struct {
+    gint        ref_count;
+    BufferPool *pool;
+    guint8     *data;
+} ReadBuf;
 
 typedef struct {
     GIOStream         *io_stream;
+    gint               fd;
+    gboolean           is_socket;
     gboolean           opening;
+    GSource           *opening_source;
+    guint              opening_delay;
     VDAgentConnErrorCb error_cb;
     GCancellable      *cancellable;
+    BufferPool        *pool;
+
+    GQueue             write_queues[VDAGENT_CONNECTION_N_PRIORITIES];
+    gint               write_prio;     /* queue of the message in progress or -1 */
+    gsize              bytes_written;  /* of the first buffer in progress */
+    gsize              queued_bytes;
+    gsize              low_mark;
+    gsize              high_mark;
+    gboolean           congested;
+    VDAgentConnWatermarkCb watermark_cb;
+    GSource           *write_source;
+    gpointer           write_tag;
+#ifdef HAVE_LIBURING
+    Uring             *uring;
+#endif
 
-    GQueue            *write_queue;
-    gsize              bytes_written;
+    GMainContext      *read_context;
+    GSource           *read_source;
+    gpointer           read_tag;
+    gboolean           read_paused;
+    gboolean           read_stopped;
+    ReadBuf           *read_buf;
+    gsize              read_start;
+    gsize              read_end;
 
     gsize              header_size;
     gpointer           header_buf;
+    gboolean           header_read;
+    gsize              data_size;
     gpointer           data_buf;
+    gsize              data_pos;
+
+    /* body of the message passed to handle_message() */
+    gboolean           dispatching;
+    gpointer           message_data;
+    GBytes            *message_bytes;
 } VDAgentConnectionPrivate;
 
+/* A buffer waiting in one of the write queues */
+typedef struct {
+    GBytes  *bytes;
+    gboolean last;  /* last buffer of its message */
+} WriteBuf;
+
 G_DEFINE_TYPE_WITH_PRIVATE(VDAgentConnection, vdagent_connection, G_TYPE_OBJECT)
 
-static void read_next_message(VDAgentConnection *self);
+static ReadBuf *read_buf_new(BufferPool *pool)
+{
+    ReadBuf *buf = g_new(ReadBuf, 1);
+
+    buf->ref_count = 1;
+    buf->pool = buffer_pool_ref(pool);
+    buf->data = buffer_pool_alloc(pool, READ_BUF_SIZE);
+    return buf;
+}
+
+static void read_buf_unref(gpointer p)
+{
+    ReadBuf *buf = p;
+
+    if (!g_atomic_int_dec_and_test(&buf->ref_count)) {
+        return;
+    }
+    buffer_pool_release(buf->data);
+    buffer_pool_unref(buf->pool);
+    g_free(buf);
+}
+
+/* GSource watching the connection's FD,
+ * the FD is added and removed using g_source_add/remove_unix_fd() */
+static gboolean fd_source_dispatch(GSource    *source,
+                                   GSourceFunc callback,
+                                   gpointer    user_data)
+{
+    return callback(user_data);
+}
+
+static GSourceFuncs fd_source_funcs = {
+    .dispatch = fd_source_dispatch,
+};
+
+static GSource *fd_source_new(VDAgentConnection *self,
+                              GSourceFunc        func,
+                              GMainContext      *context)
+{
+    GSource *source = g_source_new(&fd_source_funcs, sizeof(GSource));
+
+    g_source_set_callback(source, func, g_object_ref(self), g_object_unref);
+    g_source_attach(source, context);
+    return source;
+}
+
+static void stop_source(GSource **source)
+{
+    if (*source) {
+        g_source_destroy(*source);
+        g_clear_pointer(source, g_source_unref);
+    }
+}
+
+#ifdef HAVE_LIBURING
+static gboolean uring_setup(VDAgentConnection *self);
+static void uring_free(VDAgentConnectionPrivate *priv);
+#endif
+
+static gboolean write_queues_empty(VDAgentConnectionPrivate *priv)
+{
+    gint prio;
+
+    for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        if (!g_queue_is_empty(&priv->write_queues[prio])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Returns TRUE if some of the queued data can be written, that's not the case
+ * while waiting for further parts of the message in progress */
+static gboolean write_pending(VDAgentConnectionPrivate *priv)
+{
+    if (priv->write_prio >= 0) {
+        return !g_queue_is_empty(&priv->write_queues[priv->write_prio]);
+    }
+    return !write_queues_empty(priv);
+}
+
+static void write_buf_free(WriteBuf *buf)
+{
+    g_bytes_unref(buf->bytes);
+    g_free(buf);
+}
 
 GIOStream *vdagent_file_open(const gchar *path, GError **err)
 {
     gint fd, errsv;
 
-    fd = g_open(path, O_RDWR);
+    /* writes coalesce several messages, which mustn't block the main loop
+     * if the other side can take only part of them */
+    fd = g_open(path, O_RDWR | O_NONBLOCK);
     if (fd == -1) {
         errsv = errno;
         g_set_error_literal(err, G_FILE_ERROR,
@@ -81,8 +272,15 @@ GIOStream *vdagent_socket_connect(const gchar *path, GError **err)
 static void vdagent_connection_init(VDAgentConnection *self)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    gint prio;
+
+    priv->fd = -1;
     priv->cancellable = g_cancellable_new();
-    priv->write_queue = g_queue_new();
+    priv->pool = buffer_pool_new();
+    for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        g_queue_init(&priv->write_queues[prio]);
+    }
+    priv->write_prio = -1;
 }
 
 static void vdagent_connection_dispose(GObject *obj)
@@ -90,6 +288,12 @@ static void vdagent_connection_dispose(GObject *obj)
     VDAgentConnection *self = VDAGENT_CONNECTION(obj);
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
 
+    stop_source(&priv->read_source);
+    stop_source(&priv->write_source);
+    stop_source(&priv->opening_source);
+#ifdef HAVE_LIBURING
+    uring_free(priv);
+#endif
     g_clear_object(&priv->cancellable);
     g_clear_object(&priv->io_stream);
 
@@ -100,10 +304,19 @@ static void vdagent_connection_finalize(GObject *obj)
 {
     VDAgentConnection *self = VDAGENT_CONNECTION(obj);
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    WriteBuf *buf;
+    gint prio;
 
-    g_queue_free_full(priv->write_queue, (GDestroyNotify)g_bytes_unref);
+    for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        while ((buf = g_queue_pop_head(&priv->write_queues[prio]))) {
+            write_buf_free(buf);
+        }
+    }
+    g_clear_pointer(&priv->read_buf, read_buf_unref);
+    g_clear_pointer(&priv->read_context, g_main_context_unref);
     g_free(priv->header_buf);
-    g_free(priv->data_buf);
+    buffer_pool_release(priv->data_buf);
+    buffer_pool_unref(priv->pool);
 
     G_OBJECT_CLASS(vdagent_connection_parent_class)->finalize(obj);
 }
@@ -115,6 +328,9 @@ static void vdagent_connection_class_init(VDAgentConnectionClass *klass)
     gobject_class->finalize = vdagent_connection_finalize;
 }
 
+static gboolean in_fd_ready_cb(gpointer user_data);
+static gboolean out_fd_ready_cb(gpointer user_data);
+
 void vdagent_connection_setup(VDAgentConnection *self,
                               GIOStream         *io_stream,
                               gboolean           wait_on_opening,
@@ -122,13 +338,57 @@ void vdagent_connection_setup(VDAgentConnection *self,
                               VDAgentConnErrorCb error_cb)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GOutputStream *out;
+
     priv->io_stream = io_stream;
     priv->opening = wait_on_opening;
     priv->header_size = header_size;
     priv->header_buf = g_malloc(header_size);
+    priv->read_buf = read_buf_new(priv->pool);
     priv->error_cb = error_cb;
 
-    read_next_message(self);
+    if (G_IS_SOCKET_CONNECTION(io_stream)) {
+        priv->fd = g_socket_get_fd(
+            g_socket_connection_get_socket(G_SOCKET_CONNECTION(io_stream)));
+        priv->is_socket = TRUE;
+    } else {
+        out = g_io_stream_get_output_stream(io_stream);
+        priv->fd = g_unix_output_stream_get_fd(G_UNIX_OUTPUT_STREAM(out));
+    }
+
+#ifdef HAVE_LIBURING
+    /* reads and writes complete on the same ring,
+     * which can't be shared by two contexts */
+    if (priv->read_context == NULL) {
+        if (uring_setup(self)) {
+            return;
+        }
+    } else {
+        syslog(LOG_INFO, "io_uring is not used for connections read "
+               "from another thread, using poll based I/O");
+    }
+#endif
+
+    /* The write source stays attached for the whole lifetime of the
+     * connection, the FD is only polled while the write queue is non-empty */
+    priv->write_source = fd_source_new(self, out_fd_ready_cb, NULL);
+    /* incoming data is read in bulk and parsed by parse_messages() */
+    priv->read_source = fd_source_new(self, in_fd_ready_cb,
+                                      priv->read_context);
+    priv->read_tag = g_source_add_unix_fd(priv->read_source, priv->fd, G_IO_IN);
+}
+
+void vdagent_connection_set_read_context(VDAgentConnection *self,
+                                         GMainContext      *context)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(priv->io_stream == NULL);
+
+    g_clear_pointer(&priv->read_context, g_main_context_unref);
+    if (context) {
+        priv->read_context = g_main_context_ref(context);
+    }
 }
 
 void vdagent_connection_destroy(gpointer p)
@@ -138,10 +398,28 @@ void vdagent_connection_destroy(gpointer p)
     VDAgentConnection *self = VDAGENT_CONNECTION(p);
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
     g_cancellable_cancel(priv->cancellable);
+    stop_source(&priv->read_source);
+    stop_source(&priv->write_source);
+    stop_source(&priv->opening_source);
+#ifdef HAVE_LIBURING
+    uring_free(priv);
+#endif
     g_io_stream_close(priv->io_stream, NULL, NULL);
+
+    /* the queued data is dropped, so let the owner know it's gone */
+    if (priv->congested) {
+        priv->congested = FALSE;
+        priv->watermark_cb(self, FALSE);
+    }
     g_object_unref(self);
 }
 
+BufferPool *vdagent_connection_get_buffer_pool(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    return priv->pool;
+}
+
 PidUid vdagent_connection_get_peer_pid_uid(VDAgentConnection *self,
                                            GError           **err)
 {
@@ -163,157 +441,1039 @@ PidUid vdagent_connection_get_peer_pid_uid(VDAgentConnection *self,
     return pid_uid;
 }
 
-/* Performs single write operation,
- * returns TRUE if there's still data to be written, otherwise FALSE. */
-static gboolean do_write(VDAgentConnection *self, gboolean block)
+#ifdef HAVE_LIBURING
+static void uring_schedule(VDAgentConnectionPrivate *priv);
+static gboolean uring_read_in_flight(VDAgentConnectionPrivate *priv);
+#endif
+
+static void update_write_watch(VDAgentConnection *self)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
-    GOutputStream *out;
-    GBytes *msg;
+
+#ifdef HAVE_LIBURING
+    if (priv->uring) {
+        if (write_pending(priv)) {
+            uring_schedule(priv);
+        }
+        return;
+    }
+#endif
+    if (priv->write_source == NULL) {
+        return;
+    }
+    /* an idle FD would keep waking us up once the other side hangs up */
+    if (!write_pending(priv)) {
+        if (priv->write_tag) {
+            g_source_remove_unix_fd(priv->write_source, priv->write_tag);
+            priv->write_tag = NULL;
+        }
+    } else if (priv->write_tag == NULL) {
+        priv->write_tag = g_source_add_unix_fd(priv->write_source, priv->fd,
+                                               G_IO_OUT);
+    }
+}
+
+/* Writes @iov to the connection's FD,
+ * MSG_NOSIGNAL is used for sockets so that a closed peer doesn't raise SIGPIPE.
+ * If @block is TRUE, waits until the FD becomes writable. */
+static gssize write_iov(VDAgentConnectionPrivate *priv,
+                        struct iovec             *iov,
+                        gint                      n_iov,
+                        gboolean                  block)
+{
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = n_iov,
+    };
+    struct pollfd pfd = {
+        .fd = priv->fd,
+        .events = POLLOUT,
+    };
     gssize res;
-    GError *err = NULL;
 
-    msg = g_queue_peek_head(priv->write_queue);
-    out = g_io_stream_get_output_stream(priv->io_stream);
+    while (TRUE) {
+        if (priv->is_socket) {
+            res = sendmsg(priv->fd, &msg, MSG_NOSIGNAL);
+        } else {
+            res = writev(priv->fd, iov, n_iov);
+        }
+        if (res >= 0) {
+            return res;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (!block || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return -1;
+        }
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
 
-    if (!msg) {
+static void add_iov(struct iovec *iov, WriteBuf *buf)
+{
+    gsize size;
+
+    iov->iov_base = (gpointer) g_bytes_get_data(buf->bytes, &size);
+    iov->iov_len = size;
+}
+
+/* Fills @iov with up to MAX_WRITE_IOV queued buffers in the order they are
+ * to be written, @prios is set to the queue each of the buffers is from.
+ * Nothing is collected past a message whose last part isn't queued yet.
+ * Returns the number of buffers. */
+static gint collect_iov(VDAgentConnectionPrivate *priv,
+                        struct iovec             *iov,
+                        gint8                    *prios)
+{
+    GList *next[VDAGENT_CONNECTION_N_PRIORITIES];
+    GList *l;
+    WriteBuf *buf;
+    gint n_iov = 0, prio;
+
+    for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        next[prio] = g_queue_peek_head_link(&priv->write_queues[prio]);
+    }
+    /* the message in progress has to be finished first,
+     * higher priority messages can only jump ahead at message boundaries */
+    prio = priv->write_prio;
+    if (prio >= 0) {
+        do {
+            if (next[prio] == NULL) {
+                goto done;
+            }
+            buf = next[prio]->data;
+            prios[n_iov] = prio;
+            add_iov(&iov[n_iov++], buf);
+            next[prio] = next[prio]->next;
+        } while (!buf->last && n_iov < MAX_WRITE_IOV);
+    }
+    for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        for (l = next[prio]; l != NULL && n_iov < MAX_WRITE_IOV; l = l->next) {
+            buf = l->data;
+            prios[n_iov] = prio;
+            add_iov(&iov[n_iov++], buf);
+            if (!buf->last && l->next == NULL) {
+                goto done;
+            }
+        }
+    }
+done:
+    /* the first buffer might have been written partially */
+    iov[0].iov_base += priv->bytes_written;
+    iov[0].iov_len -= priv->bytes_written;
+
+    return n_iov;
+}
+
+/* Removes @res written bytes from the queues @prios as filled by collect_iov(),
+ * returns TRUE if there's still data to be written, otherwise FALSE. */
+static gboolean consume_written(VDAgentConnection *self,
+                                const gint8       *prios,
+                                gint               n_iov,
+                                gsize              res)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GQueue *queue;
+    WriteBuf *buf;
+    gsize size;
+    gint i;
+
+    priv->queued_bytes -= res;
+    for (i = 0; i < n_iov; i++) {
+        queue = &priv->write_queues[prios[i]];
+        buf = g_queue_peek_head(queue);
+        size = g_bytes_get_size(buf->bytes) - priv->bytes_written;
+        if (res < size) {
+            if (res > 0) {
+                priv->bytes_written += res;
+                priv->write_prio = prios[i];
+            }
+            break;
+        }
+        res -= size;
+        priv->bytes_written = 0;
+        priv->write_prio = buf->last ? -1 : prios[i];
+        write_buf_free(g_queue_pop_head(queue));
+    }
+
+    if (priv->congested && priv->queued_bytes <= priv->low_mark) {
+        priv->congested = FALSE;
+        priv->watermark_cb(self, FALSE);
+    }
+
+    if (!write_pending(priv)) {
+        update_write_watch(self);
         return FALSE;
     }
+    return TRUE;
+}
+
+#ifdef HAVE_LIBURING
+static void uring_stop_writing(VDAgentConnectionPrivate *priv);
+static void uring_stop_reading(VDAgentConnectionPrivate *priv);
+#endif
+
+static void write_failed(VDAgentConnection *self, gint errsv)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GError *err;
+
+    /* stop writing, the error_cb is expected to destroy the connection */
+    stop_source(&priv->write_source);
+#ifdef HAVE_LIBURING
+    uring_stop_writing(priv);
+#endif
+    err = g_error_new_literal(G_IO_ERROR, g_io_error_from_errno(errsv),
+                              g_strerror(errsv));
+    priv->error_cb(self, err);
+}
 
-    res = g_pollable_stream_write(out,
-        g_bytes_get_data(msg, NULL) + priv->bytes_written,
-        g_bytes_get_size(msg) - priv->bytes_written,
-        block, priv->cancellable, &err);
+/* Writes as many queued messages as possible using a single syscall,
+ * returns TRUE if there's still data to be written, otherwise FALSE. */
+static gboolean do_write(VDAgentConnection *self, gboolean block)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    struct iovec iov[MAX_WRITE_IOV];
+    gint8 prios[MAX_WRITE_IOV];
+    gint n_iov, errsv;
+    gssize res;
 
-    if (err) {
-        if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
-            g_error_free(err);
+    if (!write_pending(priv) ||
+        g_cancellable_is_cancelled(priv->cancellable)) {
+        return FALSE;
+    }
+
+    n_iov = collect_iov(priv, iov, prios);
+    res = write_iov(priv, iov, n_iov, block);
+    if (res < 0) {
+        errsv = errno;
+        if (errsv == EAGAIN || errsv == EWOULDBLOCK) {
             return TRUE;
-        } else if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-            g_error_free(err);
-            return FALSE;
-        } else {
-            priv->error_cb(self, err);
-            return FALSE;
         }
+        write_failed(self, errsv);
+        return FALSE;
     }
 
-    priv->bytes_written += res;
+    return consume_written(self, prios, n_iov, res);
+}
 
-    if (priv->bytes_written == g_bytes_get_size(msg)) {
-        g_bytes_unref(g_queue_pop_head(priv->write_queue));
-        priv->bytes_written = 0;
+static gboolean out_fd_ready_cb(gpointer user_data)
+{
+    do_write(user_data, FALSE);
+    return G_SOURCE_CONTINUE;
+}
+
+static void queue_part(VDAgentConnectionPrivate *priv,
+                       VDAgentConnectionPriority priority,
+                       GBytes                   *bytes,
+                       gboolean                  last)
+{
+    WriteBuf *buf;
+
+    /* nothing gets written after the connection was destroyed */
+    if (g_cancellable_is_cancelled(priv->cancellable)) {
+        return;
     }
 
-    return !g_queue_is_empty(priv->write_queue);
+    buf = g_new(WriteBuf, 1);
+    buf->bytes = g_bytes_ref(bytes);
+    buf->last = last;
+    g_queue_push_tail(&priv->write_queues[priority], buf);
+    priv->queued_bytes += g_bytes_get_size(bytes);
 }
 
-static gboolean out_stream_ready_cb(GObject *pollable_stream,
-                                    gpointer user_data)
+static void check_high_mark(VDAgentConnection *self)
 {
-    return do_write(user_data, FALSE);
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (priv->watermark_cb && !priv->congested &&
+        priv->queued_bytes >= priv->high_mark) {
+        priv->congested = TRUE;
+        priv->watermark_cb(self, TRUE);
+    }
+}
+
+void vdagent_connection_write_message(VDAgentConnection        *self,
+                                      VDAgentConnectionPriority priority,
+                                      GBytes                  **parts,
+                                      guint                     n_parts)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint i;
+
+    g_return_if_fail(priority < VDAGENT_CONNECTION_N_PRIORITIES);
+    g_return_if_fail(n_parts > 0);
+
+    for (i = 0; i < n_parts; i++) {
+        queue_part(priv, priority, parts[i], i == n_parts - 1);
+    }
+
+    update_write_watch(self);
+    check_high_mark(self);
+}
+
+void vdagent_connection_write_message_part(VDAgentConnection        *self,
+                                           VDAgentConnectionPriority priority,
+                                           GBytes                   *part,
+                                           gboolean                  last)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(priority < VDAGENT_CONNECTION_N_PRIORITIES);
+
+    queue_part(priv, priority, part, last);
+    update_write_watch(self);
+    check_high_mark(self);
+}
+
+void vdagent_connection_write_bytes(VDAgentConnection *self,
+                                    GBytes            *bytes)
+{
+    vdagent_connection_write_message(self, VDAGENT_CONNECTION_PRIORITY_CONTROL,
+                                     &bytes, 1);
 }
 
 void vdagent_connection_write(VDAgentConnection *self,
                               gpointer           data,
                               gsize              size)
+{
+    GBytes *bytes = g_bytes_new_take(data, size);
+
+    vdagent_connection_write_bytes(self, bytes);
+    g_bytes_unref(bytes);
+}
+
+#ifdef HAVE_LIBURING
+static void uring_wait_write(VDAgentConnection *self);
+#endif
+
+void vdagent_connection_flush(VDAgentConnection *self)
+{
+#ifdef HAVE_LIBURING
+    uring_wait_write(self);
+#endif
+    while (do_write(self, TRUE));
+}
+
+void vdagent_connection_set_watermarks(VDAgentConnection     *self,
+                                       gsize                  low_mark,
+                                       gsize                  high_mark,
+                                       VDAgentConnWatermarkCb watermark_cb)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
-    GPollableOutputStream *out;
-    GSource *source;
 
-    g_queue_push_tail(priv->write_queue, g_bytes_new_take(data, size));
+    g_return_if_fail(low_mark < high_mark);
 
-    if (g_queue_get_length(priv->write_queue) == 1) {
-        out = G_POLLABLE_OUTPUT_STREAM(g_io_stream_get_output_stream(priv->io_stream));
+    priv->low_mark = low_mark;
+    priv->high_mark = high_mark;
+    priv->watermark_cb = watermark_cb;
+}
 
-        source = g_pollable_output_stream_create_source(out, priv->cancellable);
-        g_source_set_callback(source, (GSourceFunc) out_stream_ready_cb,
-            g_object_ref(self), g_object_unref);
-        g_source_attach(source, NULL);
-        g_source_unref(source);
+gsize vdagent_connection_get_queued_bytes(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    return priv->queued_bytes;
+}
+
+/* Reading is suspended while paused by the owner
+ * or while waiting for the other side to open the connection */
+static gboolean reading_suspended(VDAgentConnectionPrivate *priv)
+{
+    return priv->read_paused || priv->opening_source != NULL;
+}
+
+/* Reading stops for good once the connection is destroyed
+ * or vdagent_connection_stop_reading() was called */
+static gboolean reading_stopped(VDAgentConnectionPrivate *priv)
+{
+    return priv->read_stopped || g_cancellable_is_cancelled(priv->cancellable);
+}
+
+static void update_read_watch(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+#ifdef HAVE_LIBURING
+    /* a posted read still completes, but no new one is posted while suspended */
+    if (priv->uring) {
+        if (!reading_suspended(priv)) {
+            uring_schedule(priv);
+        }
+        return;
+    }
+#endif
+    if (priv->read_source == NULL) {
+        return;
+    }
+    /* the FD is removed, as G_IO_HUP would be reported even without G_IO_IN */
+    if (reading_suspended(priv)) {
+        if (priv->read_tag) {
+            g_source_remove_unix_fd(priv->read_source, priv->read_tag);
+            priv->read_tag = NULL;
+        }
+        return;
+    }
+    if (priv->read_tag == NULL) {
+        priv->read_tag = g_source_add_unix_fd(priv->read_source, priv->fd,
+                                              G_IO_IN);
+    }
+    /* messages which are already buffered get parsed in the next iteration */
+    if (priv->read_end > priv->read_start) {
+        g_source_set_ready_time(priv->read_source, 0);
     }
 }
 
-void vdagent_connection_flush(VDAgentConnection *self)
+void vdagent_connection_set_read_paused(VDAgentConnection *self,
+                                        gboolean           paused)
 {
-    while (do_write(self, TRUE));
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (priv->read_paused == paused) {
+        return;
+    }
+    priv->read_paused = paused;
+    update_read_watch(self);
 }
 
-static void message_read_cb(GObject      *source_object,
-                            GAsyncResult *res,
-                            gpointer      user_data)
+void vdagent_connection_stop_reading(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    priv->read_stopped = TRUE;
+    stop_source(&priv->read_source);
+    stop_source(&priv->opening_source);
+#ifdef HAVE_LIBURING
+    uring_stop_reading(priv);
+#endif
+}
+
+static void wait_for_opening(VDAgentConnection *self);
+
+/* Checks whether the other side opened the connection in the meantime,
+ * without blocking */
+static gboolean opening_timeout_cb(gpointer user_data)
 {
     VDAgentConnection *self = user_data;
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
-    GInputStream *in = G_INPUT_STREAM(source_object);
-    GError *err = NULL;
-    gsize bytes_read, data_size;
+    struct pollfd pfd = {
+        .fd = priv->fd,
+        .events = POLLIN,
+    };
+
+    g_clear_pointer(&priv->opening_source, g_source_unref);
 
-    g_input_stream_read_all_finish(in, res, &bytes_read, &err);
-    if (err) {
-        if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-            g_error_free(err);
+    if (poll(&pfd, 1, 0) > 0 &&
+        (pfd.revents & (POLLIN | POLLHUP)) == POLLHUP) {
+        wait_for_opening(self);
+    } else {
+        update_read_watch(self);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* See virtio-port.c for the rationale behind this.
+ * Until the other side opens the connection, reads return 0 and POLLHUP
+ * is reported, so the FD is checked by a timer with an exponential backoff
+ * instead of blocking the main loop. */
+static void wait_for_opening(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (priv->opening_delay == 0) {
+        priv->opening_delay = OPENING_MIN_DELAY;
+    } else {
+        priv->opening_delay = MIN(priv->opening_delay * 2, OPENING_MAX_DELAY);
+    }
+
+    priv->opening_source = g_timeout_source_new(priv->opening_delay);
+    g_source_set_callback(priv->opening_source, opening_timeout_cb,
+                          g_object_ref(self), g_object_unref);
+    g_source_attach(priv->opening_source, priv->read_context);
+    update_read_watch(self);
+}
+
+/* The read buffer is used as a ring: once the data of an incomplete message
+ * hits the end of the buffer, it's moved back to its start.
+ * While slices of the buffer are referenced, the data is moved to a new
+ * buffer instead, not to overwrite the messages still in use. */
+static void prepare_read_buf(VDAgentConnectionPrivate *priv)
+{
+    gsize pending = priv->read_end - priv->read_start;
+    gboolean shared = g_atomic_int_get(&priv->read_buf->ref_count) > 1;
+    ReadBuf *buf;
+
+    if (pending == 0 && !shared) {
+        priv->read_start = priv->read_end = 0;
+        return;
+    }
+    if (priv->read_end == READ_BUF_SIZE ||
+        (priv->header_read && priv->read_start + priv->data_size > READ_BUF_SIZE)) {
+        if (shared) {
+            buf = read_buf_new(priv->pool);
+            memcpy(buf->data, priv->read_buf->data + priv->read_start, pending);
+            read_buf_unref(priv->read_buf);
+            priv->read_buf = buf;
         } else {
-            priv->error_cb(self, err);
+            memmove(priv->read_buf->data,
+                    priv->read_buf->data + priv->read_start, pending);
         }
-        goto unref;
+        priv->read_start = 0;
+        priv->read_end = pending;
     }
+}
+
+/* Returns the space the next read should go to */
+static guint8 *get_read_space(VDAgentConnectionPrivate *priv, gsize *count)
+{
+    if (priv->data_buf) {
+        /* large message bodies are read directly into their own buffer */
+        *count = priv->data_size - priv->data_pos;
+        return (guint8 *) priv->data_buf + priv->data_pos;
+    }
+    prepare_read_buf(priv);
+    *count = READ_BUF_SIZE - priv->read_end;
+    return priv->read_buf->data + priv->read_end;
+}
+
+/* Passes the current message to handle_message() and resets the reader,
+ * returns FALSE if the connection got destroyed by the handler */
+static gboolean dispatch_message(VDAgentConnection *self, gpointer data)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    priv->dispatching = TRUE;
+    priv->message_data = data;
+    VDAGENT_CONNECTION_GET_CLASS(self)->handle_message(
+        self, priv->header_buf, data);
+    priv->dispatching = FALSE;
+    priv->message_data = NULL;
+    g_clear_pointer(&priv->message_bytes, g_bytes_unref);
+
+    priv->header_read = FALSE;
+    g_clear_pointer(&priv->data_buf, buffer_pool_release);
+    priv->data_pos = 0;
+    return !reading_stopped(priv);
+}
 
-    if (bytes_read == 0) {
-        /* see virtio-port.c for the rationale behind this */
-        if (priv->opening) {
-            g_usleep(10000);
-            read_next_message(self);
+GBytes *vdagent_connection_get_message_bytes(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_val_if_fail(priv->dispatching, NULL);
+
+    if (priv->message_bytes == NULL) {
+        if (priv->message_data == NULL) {
+            priv->message_bytes = g_bytes_new(NULL, 0);
+        } else if (priv->message_data == priv->data_buf) {
+            /* the body has its own buffer, hand it over */
+            priv->message_bytes = buffer_pool_bytes_new_take(priv->data_buf,
+                                                             priv->data_size);
+            priv->data_buf = NULL;
         } else {
-            priv->error_cb(self, NULL);
+            g_atomic_int_inc(&priv->read_buf->ref_count);
+            priv->message_bytes = g_bytes_new_with_free_func(
+                priv->message_data, priv->data_size,
+                read_buf_unref, priv->read_buf);
         }
-        goto unref;
+    }
+    return g_bytes_ref(priv->message_bytes);
+}
+
+/* Handles all complete messages in the read buffer.
+ * Message bodies are passed to handle_message() in place if suitably aligned,
+ * bodies that don't fit into the read buffer are read into a separate one. */
+static void parse_messages(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint8 *data;
+    gsize avail;
+
+    if (priv->data_buf) {
+        return;
+    }
+
+    while (!priv->read_paused && !reading_stopped(priv)) {
+        avail = priv->read_end - priv->read_start;
+
+        if (!priv->header_read) {
+            if (avail < priv->header_size) {
+                return;
+            }
+            /* copy the header, so that handlers can access it aligned */
+            memcpy(priv->header_buf, priv->read_buf->data + priv->read_start,
+                   priv->header_size);
+            priv->read_start += priv->header_size;
+            avail -= priv->header_size;
+            priv->header_read = TRUE;
+
+            priv->data_size = VDAGENT_CONNECTION_GET_CLASS(self)->handle_header(
+                self, priv->header_buf);
+            if (reading_stopped(priv)) {
+                return;
+            }
+        }
+
+        data = priv->read_buf->data + priv->read_start;
+
+        if (priv->data_size > READ_BUF_SIZE) {
+#ifdef HAVE_LIBURING
+            /* switched to its own buffer once the posted read completed,
+             * as it still goes to the read buffer */
+            if (uring_read_in_flight(priv)) {
+                return;
+            }
+#endif
+            priv->data_buf = buffer_pool_alloc(priv->pool, priv->data_size);
+            memcpy(priv->data_buf, data, avail);
+            priv->data_pos = avail;
+            priv->read_start = priv->read_end;
+            return;
+        }
+        if (avail < priv->data_size) {
+            return;
+        }
+        priv->read_start += priv->data_size;
+
+        if (priv->data_size == 0) {
+            data = NULL;
+        } else if ((guintptr) data % DATA_ALIGNMENT != 0) {
+            priv->data_buf = buffer_pool_alloc(priv->pool, priv->data_size);
+            data = memcpy(priv->data_buf, data, priv->data_size);
+        }
+        if (!dispatch_message(self, data)) {
+            return;
+        }
+    }
+}
+
+static void messages_done(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    VDAgentConnectionClass *klass = VDAGENT_CONNECTION_GET_CLASS(self);
+
+    if (klass->handle_messages_done && !reading_stopped(priv)) {
+        klass->handle_messages_done(self);
+    }
+}
+
+/* Processes the result of a read into the space returned by get_read_space(),
+ * a negative @res is an errno value. */
+static void handle_read(VDAgentConnection *self, gssize res)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GError *err = NULL;
+
+    /* a read posted before reading was stopped may still complete */
+    if (priv->read_stopped) {
+        return;
+    }
+
+    if (res <= 0) {
+        if (res == 0 && priv->opening) {
+            wait_for_opening(self);
+            return;
+        }
+        stop_source(&priv->read_source);
+#ifdef HAVE_LIBURING
+        uring_stop_reading(priv);
+#endif
+        if (res < 0) {
+            err = g_error_new_literal(G_IO_ERROR, g_io_error_from_errno(-res),
+                                      g_strerror(-res));
+        }
+        priv->error_cb(self, err);
+        return;
     }
     priv->opening = FALSE;
 
-    if (!priv->data_buf) {
-        /* we've read the message header, now let's read its body */
-        data_size = VDAGENT_CONNECTION_GET_CLASS(self)->handle_header(
-            self, priv->header_buf);
+    if (priv->data_buf) {
+        priv->data_pos += res;
+        if (priv->data_pos < priv->data_size ||
+            !dispatch_message(self, priv->data_buf)) {
+            return;
+        }
+    } else {
+        priv->read_end += res;
+    }
 
-        if (g_cancellable_is_cancelled(priv->cancellable)) {
-            goto unref;
+    parse_messages(self);
+    messages_done(self);
+}
+
+static gboolean in_fd_ready_cb(gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint8 *buf;
+    gsize count;
+    gssize res;
+
+    if (g_cancellable_is_cancelled(priv->cancellable)) {
+        return G_SOURCE_REMOVE;
+    }
+
+    /* dispatched after reading was resumed, the FD might not be ready */
+    if (g_source_get_ready_time(priv->read_source) != -1) {
+        g_source_set_ready_time(priv->read_source, -1);
+        if (reading_suspended(priv) ||
+            !(g_source_query_unix_fd(priv->read_source, priv->read_tag) &
+              (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+            parse_messages(self);
+            messages_done(self);
+            return G_SOURCE_CONTINUE;
         }
+    }
 
-        if (data_size > 0) {
-            priv->data_buf = g_malloc(data_size);
-            g_input_stream_read_all_async(in,
-                priv->data_buf, data_size,
-                G_PRIORITY_DEFAULT, priv->cancellable,
-                message_read_cb, g_object_ref(self));
-            goto unref;
+    buf = get_read_space(priv, &count);
+    res = read(priv->fd, buf, count);
+    if (res < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            return G_SOURCE_CONTINUE;
         }
+        res = -errno;
     }
 
-    VDAGENT_CONNECTION_GET_CLASS(self)->handle_message(
-        self, priv->header_buf, priv->data_buf);
+    handle_read(self, res);
+    return G_SOURCE_CONTINUE;
+}
 
-    g_clear_pointer(&priv->data_buf, g_free);
-    read_next_message(self);
+#ifdef HAVE_LIBURING
 
-unref:
-    g_object_unref(self);
+enum {
+    URING_OP_READ = 1,
+    URING_OP_WRITE,
+    URING_OP_CANCEL,
+    URING_OP_READ_POLL,
+    URING_OP_WRITE_POLL,
+};
+
+static struct io_uring_sqe *uring_get_sqe(Uring *uring)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&uring->ring);
+
+    /* there are never more requests pending than URING_ENTRIES */
+    g_assert(sqe != NULL);
+    return sqe;
+}
+
+/* A read posted to the ring goes to the space returned by
+ * get_read_space() when it was posted, which must not change until
+ * the read completes */
+static gboolean uring_read_in_flight(VDAgentConnectionPrivate *priv)
+{
+    return priv->uring && priv->uring->reading &&
+           priv->uring->read_op == URING_OP_READ;
+}
+
+/* Runs uring_ready_cb() in the next main loop iteration, so that
+ * all the messages queued until then are submitted together */
+static void uring_schedule(VDAgentConnectionPrivate *priv)
+{
+    g_source_set_ready_time(priv->uring->source, 0);
+}
+
+static void uring_post_read(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    Uring *uring = priv->uring;
+    struct io_uring_sqe *sqe;
+
+    if (uring->reading || uring->read_stopped || reading_suspended(priv)) {
+        return;
+    }
+
+    uring->read_iov.iov_base = get_read_space(priv, &uring->read_iov.iov_len);
+    sqe = uring_get_sqe(uring);
+    io_uring_prep_readv(sqe, priv->fd, &uring->read_iov, 1, -1);
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(URING_OP_READ));
+    uring->read_op = URING_OP_READ;
+    uring->reading = TRUE;
+}
+
+static void uring_post_write(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    Uring *uring = priv->uring;
+    struct io_uring_sqe *sqe;
+
+    if (uring->writing || uring->write_stopped || !write_pending(priv)) {
+        return;
+    }
+
+    uring->n_write_iov = collect_iov(priv, uring->write_iov, uring->write_prios);
+    sqe = uring_get_sqe(uring);
+    if (priv->is_socket) {
+        uring->write_msg.msg_iov = uring->write_iov;
+        uring->write_msg.msg_iovlen = uring->n_write_iov;
+        io_uring_prep_sendmsg(sqe, priv->fd, &uring->write_msg, MSG_NOSIGNAL);
+    } else {
+        io_uring_prep_writev(sqe, priv->fd, uring->write_iov,
+                             uring->n_write_iov, -1);
+    }
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(URING_OP_WRITE));
+    uring->write_op = URING_OP_WRITE;
+    uring->writing = TRUE;
+}
+
+/* Posts a poll for @mask in place of a request which returned EAGAIN,
+ * the request is posted again once the poll completes */
+static void uring_post_poll(VDAgentConnectionPrivate *priv,
+                            guint op, unsigned int mask)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(priv->uring);
+
+    io_uring_prep_poll_add(sqe, priv->fd, mask);
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(op));
+    io_uring_submit(&priv->uring->ring);
+}
+
+static void uring_stop_reading(VDAgentConnectionPrivate *priv)
+{
+    if (priv->uring) {
+        priv->uring->read_stopped = TRUE;
+    }
+}
+
+static void uring_stop_writing(VDAgentConnectionPrivate *priv)
+{
+    if (priv->uring) {
+        priv->uring->write_stopped = TRUE;
+    }
+}
+
+static void uring_write_done(VDAgentConnection *self, gint res)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    Uring *uring = priv->uring;
+
+    if (res == -EAGAIN) {
+        /* still writing, until the FD becomes writable */
+        uring->write_op = URING_OP_WRITE_POLL;
+        uring_post_poll(priv, URING_OP_WRITE_POLL, POLLOUT);
+        return;
+    }
+    uring->writing = FALSE;
+    if (res == -EINTR) {
+        /* nothing else might post the write again */
+        uring_schedule(priv);
+        return;
+    }
+    if (res < 0) {
+        write_failed(self, -res);
+        return;
+    }
+    consume_written(self, uring->write_prios, uring->n_write_iov, res);
 }
 
-static void read_next_message(VDAgentConnection *self)
+static void uring_read_done(VDAgentConnection *self, gint res)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
-    GInputStream *in;
+
+    if (res == -EAGAIN) {
+        priv->uring->read_op = URING_OP_READ_POLL;
+        uring_post_poll(priv, URING_OP_READ_POLL, POLLIN);
+        return;
+    }
+    priv->uring->reading = FALSE;
+    if (res == -EINTR || res == -ECANCELED) {
+        return;
+    }
+    handle_read(self, res);
+}
+
+static gboolean uring_ready_cb(gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    Uring *uring = priv->uring;
+    struct io_uring_cqe *cqe;
+    eventfd_t value;
+    guint op;
+    gint res;
 
     if (g_cancellable_is_cancelled(priv->cancellable)) {
+        return G_SOURCE_REMOVE;
+    }
+
+    /* reset the counter, completions are looked up in the ring itself */
+    eventfd_read(uring->event_fd, &value);
+
+    if (uring->read_res_pending) {
+        uring->read_res_pending = FALSE;
+        uring_read_done(self, uring->read_res);
+    }
+    while (!g_cancellable_is_cancelled(priv->cancellable) &&
+           io_uring_peek_cqe(&uring->ring, &cqe) == 0) {
+        op = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+        res = cqe->res;
+        io_uring_cqe_seen(&uring->ring, cqe);
+
+        if (op == URING_OP_READ) {
+            uring_read_done(self, res);
+        } else if (op == URING_OP_WRITE) {
+            uring_write_done(self, res);
+        } else if (op == URING_OP_READ_POLL) {
+            /* the read is posted again below */
+            uring->reading = FALSE;
+        } else if (op == URING_OP_WRITE_POLL) {
+            uring->writing = FALSE;
+        }
+    }
+    if (g_cancellable_is_cancelled(priv->cancellable)) {
+        return G_SOURCE_REMOVE;
+    }
+
+    /* scheduled after reading was resumed or new messages were queued */
+    if (g_source_get_ready_time(uring->source) != -1) {
+        g_source_set_ready_time(uring->source, -1);
+        parse_messages(self);
+        messages_done(self);
+        if (g_cancellable_is_cancelled(priv->cancellable)) {
+            return G_SOURCE_REMOVE;
+        }
+    }
+
+    uring_post_read(self);
+    uring_post_write(self);
+    io_uring_submit(&uring->ring);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Waits for the completion of a posted write,
+ * so that the rest of the queue can be written synchronously. */
+static void uring_wait_write(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    Uring *uring = priv->uring;
+    struct io_uring_cqe *cqe;
+    guint op;
+    gint res;
+
+    if (uring == NULL) {
         return;
     }
 
-    in = g_io_stream_get_input_stream(priv->io_stream);
+    while (!g_cancellable_is_cancelled(priv->cancellable) && uring->writing &&
+           io_uring_wait_cqe(&uring->ring, &cqe) == 0) {
+        op = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+        res = cqe->res;
+        io_uring_cqe_seen(&uring->ring, cqe);
 
-    g_input_stream_read_all_async(in,
-        priv->header_buf, priv->header_size,
-        G_PRIORITY_DEFAULT, priv->cancellable,
-        message_read_cb, g_object_ref(self));
+        if (op == URING_OP_WRITE) {
+            uring_write_done(self, res);
+        } else if (op == URING_OP_WRITE_POLL) {
+            /* the rest is written synchronously */
+            uring->writing = FALSE;
+        } else if (op == URING_OP_READ_POLL) {
+            uring->reading = FALSE;
+            uring_schedule(priv);
+        } else if (op == URING_OP_READ) {
+            /* handled from the main loop, not to call handlers from here */
+            uring->read_res = res;
+            uring->read_res_pending = TRUE;
+            uring_schedule(priv);
+        }
+    }
 }
+
+/* Cancels the posted requests and waits for them, as they reference
+ * our buffers, then releases the ring. */
+static void uring_free(VDAgentConnectionPrivate *priv)
+{
+    Uring *uring = priv->uring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    guint op;
+
+    if (uring == NULL) {
+        return;
+    }
+
+    if (uring->reading) {
+        sqe = uring_get_sqe(uring);
+        io_uring_prep_cancel(sqe, GUINT_TO_POINTER(uring->read_op), 0);
+        io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(URING_OP_CANCEL));
+    }
+    if (uring->writing) {
+        sqe = uring_get_sqe(uring);
+        io_uring_prep_cancel(sqe, GUINT_TO_POINTER(uring->write_op), 0);
+        io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(URING_OP_CANCEL));
+    }
+    io_uring_submit(&uring->ring);
+
+    while ((uring->reading || uring->writing) &&
+           io_uring_wait_cqe(&uring->ring, &cqe) == 0) {
+        op = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+        if (op == URING_OP_READ || op == URING_OP_READ_POLL) {
+            uring->reading = FALSE;
+        } else if (op == URING_OP_WRITE || op == URING_OP_WRITE_POLL) {
+            uring->writing = FALSE;
+        }
+        io_uring_cqe_seen(&uring->ring, cqe);
+    }
+
+    stop_source(&uring->source);
+    io_uring_queue_exit(&uring->ring);
+    close(uring->event_fd);
+    g_clear_pointer(&priv->uring, g_free);
+}
+
+/* Sets up an io_uring for the connection, returns FALSE if the kernel
+ * doesn't support the needed operations. */
+static gboolean uring_setup(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    static gboolean warned = FALSE;
+    struct io_uring_probe *probe;
+    Uring *uring;
+    gboolean supported;
+
+    uring = g_new0(Uring, 1);
+    uring->event_fd = -1;
+    if (io_uring_queue_init(URING_ENTRIES, &uring->ring, 0) < 0) {
+        g_free(uring);
+        goto unsupported;
+    }
+
+    probe = io_uring_get_probe_ring(&uring->ring);
+    supported = probe != NULL &&
+                io_uring_opcode_supported(probe, IORING_OP_READV) &&
+                io_uring_opcode_supported(probe, IORING_OP_WRITEV) &&
+                io_uring_opcode_supported(probe, IORING_OP_SENDMSG) &&
+                io_uring_opcode_supported(probe, IORING_OP_POLL_ADD) &&
+                io_uring_opcode_supported(probe, IORING_OP_ASYNC_CANCEL);
+    if (probe) {
+        io_uring_free_probe(probe);
+    }
+    if (supported) {
+        uring->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+    if (uring->event_fd < 0 ||
+        io_uring_register_eventfd(&uring->ring, uring->event_fd) < 0) {
+        if (uring->event_fd >= 0) {
+            close(uring->event_fd);
+        }
+        io_uring_queue_exit(&uring->ring);
+        g_free(uring);
+        goto unsupported;
+    }
+
+    priv->uring = uring;
+    uring->source = fd_source_new(self, uring_ready_cb, NULL);
+    g_source_add_unix_fd(uring->source, uring->event_fd, G_IO_IN);
+    uring_post_read(self);
+    io_uring_submit(&uring->ring);
+    return TRUE;
+
+unsupported:
+    if (!warned) {
+        syslog(LOG_INFO, "io_uring is not supported, using poll based I/O");
+        warned = TRUE;
+    }
+    return FALSE;
+}
+
+#endif /* HAVE_LIBURING */
@@ -23,6 +23,8 @@
 #include <gio/gio.h>
 #include <glib-object.h>
 
+#include "buffer-pool.h"
+
 G_BEGIN_DECLS
 
 #define VDAGENT_TYPE_CONNECTION vdagent_connection_get_type()
@@ -44,10 +46,16 @@ struct _VDAgentConnectionClass {
 
     /* Called when a full message has been read.
     *
-    * @header, @data must not be freed. */
+    * @header, @data must not be freed,
+    * they're only valid until the handler returns,
+    * use vdagent_connection_get_message_bytes() to keep @data. */
     void (*handle_message) (VDAgentConnection *self,
                             gpointer           header_buf,
                             gpointer           data_buf);
+
+    /* Optional, called once all of the messages which were read
+    * at once have been handled. */
+    void (*handle_messages_done) (VDAgentConnection *self);
 };
 
 /* Invoked when an error occurs during read or write.
@@ -58,7 +66,26 @@ struct _VDAgentConnectionClass {
  * VDAgentConnection will not continue with the given I/O-op that failed. */
 typedef void (*VDAgentConnErrorCb)(VDAgentConnection *self, GError *err);
 
-/* Open a file in @path for read and write.
+/* Priority classes of the write queue,
+ * control messages are not delayed by bulk data */
+typedef enum {
+    VDAGENT_CONNECTION_PRIORITY_CONTROL,
+    VDAGENT_CONNECTION_PRIORITY_BULK,
+    VDAGENT_CONNECTION_N_PRIORITIES
+} VDAgentConnectionPriority;
+
+/* Invoked when the amount of queued data reaches the high water mark
+ * (@congested is TRUE) and once it drops to the low water mark again
+ * or the connection is destroyed (@congested is FALSE). */
+typedef void (*VDAgentConnWatermarkCb)(VDAgentConnection *self, gboolean congested);
+
+/* Number of messages of one type and their total size */
+typedef struct {
+    guint64 messages;
+    guint64 bytes;
+} VDAgentMessageStats;
+
+/* Open a file in @path for non-blocking read and write.
  * Returns a new GIOStream to the given file or NULL when @err is set. */
 GIOStream *vdagent_file_open(const gchar *path, GError **err);
 
@@ -76,12 +103,23 @@ void vdagent_connection_setup(VDAgentConnection *self,
                               gsize              header_size,
                               VDAgentConnErrorCb error_cb);
 
+/* Read and parse incoming messages from @context instead of the global
+ * default main context, which may be iterated by another thread.
+ * handle_header(), handle_message(), handle_messages_done() and
+ * the error callback for failed reads are then invoked from @context,
+ * vdagent_connection_set_read_paused() must be called from it too.
+ * Everything else stays in the default main context.
+ * Such a connection uses poll based I/O, even when io_uring is available.
+ *
+ * Must be called before vdagent_connection_setup(). */
+void vdagent_connection_set_read_context(VDAgentConnection *self,
+                                         GMainContext      *context);
 
 /* Cancel running I/O-operations, close the underlying FD and
  * unref the VDAgentConnection object. */
 void vdagent_connection_destroy(gpointer p);
 
-/* Append a message to the write queue.
+/* Append a control message to the write queue.
  *
  * VDAgentConnection takes ownership of @data
  * and frees it once the message is flushed. */
@@ -89,9 +127,63 @@ void vdagent_connection_write(VDAgentConnection *self,
                               gpointer           data,
                               gsize              size);
 
+/* Append a control message in @bytes to the write queue without copying it.
+ *
+ * VDAgentConnection takes a reference on @bytes
+ * and releases it once the data is flushed. */
+void vdagent_connection_write_bytes(VDAgentConnection *self,
+                                    GBytes            *bytes);
+
+/* Append a message made of @n_parts buffers to the write queue of @priority.
+ *
+ * Messages are written in order of their priority, but a message
+ * that's already being written is always finished first. */
+void vdagent_connection_write_message(VDAgentConnection        *self,
+                                      VDAgentConnectionPriority priority,
+                                      GBytes                  **parts,
+                                      guint                     n_parts);
+
+/* Append @part of a message to the write queue of @priority,
+ * the message is complete once a part with @last set to TRUE is appended.
+ *
+ * Parts are written as soon as possible, but no other message is written
+ * after the parts of an incomplete message until it's completed. */
+void vdagent_connection_write_message_part(VDAgentConnection        *self,
+                                           VDAgentConnectionPriority priority,
+                                           GBytes                   *part,
+                                           gboolean                  last);
+
 /* Synchronously write all queued messages to the output stream. */
 void vdagent_connection_flush(VDAgentConnection *self);
 
+/* Set the water marks of the write queue, in bytes. */
+void vdagent_connection_set_watermarks(VDAgentConnection     *self,
+                                       gsize                  low_mark,
+                                       gsize                  high_mark,
+                                       VDAgentConnWatermarkCb watermark_cb);
+
+/* Returns the number of bytes waiting in the write queue. */
+gsize vdagent_connection_get_queued_bytes(VDAgentConnection *self);
+
+/* Stop or resume reading incoming messages,
+ * used to push back on the remote side. */
+void vdagent_connection_set_read_paused(VDAgentConnection *self,
+                                        gboolean           paused);
+
+/* Stop reading for good, no further messages are passed to the handlers.
+ * Used to drop the rest of a stream which can't be parsed anymore. */
+void vdagent_connection_stop_reading(VDAgentConnection *self);
+
+/* Returns a new reference to the body of the message being passed
+ * to handle_message(), without copying it.
+ *
+ * Must only be called from handle_message(). */
+GBytes *vdagent_connection_get_message_bytes(VDAgentConnection *self);
+
+/* Returns the pool used for the connection's message buffers,
+ * subclasses should allocate their per-message buffers from it. */
+BufferPool *vdagent_connection_get_buffer_pool(VDAgentConnection *self);
+
 typedef struct PidUid {
     pid_t pid;
     uid_t uid;
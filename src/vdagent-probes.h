@@ -0,0 +1,48 @@
+/*  vdagent-probes.h static tracepoints on the message paths
+
+    Copyright 2026 spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENT_PROBES_H
+#define __VDAGENT_PROBES_H
+
+/* USDT probes of the "spice_vdagent" provider, a probe costs a single nop
+ * unless it's attached to, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/sbin/spice-vdagentd:spice_vdagent:udscs_message_send
+ *                { @[arg1] = count(); }'
+ *
+ * udscs_message_received(conn, type, size)
+ * udscs_message_dispatch(conn, type, arg1, arg2, size)
+ * udscs_message_done(conn, type)
+ * udscs_message_send(conn, type, arg1, arg2, size)
+ * virtio_chunk_received(port, size)
+ * virtio_message_complete(port, type, size, opaque)
+ * virtio_message_send(port, type, size)
+ * uinput_event(type, code, value)
+ * x11_clipboard_request(selection, type)      client requests guest data
+ * x11_clipboard_data(selection, type, size)   client data for a guest request
+ * x11_clipboard_guest_request(selection, type)
+ * x11_clipboard_guest_data(selection, type, size)
+ */
+#ifdef ENABLE_USDT_PROBES
+#include <sys/sdt.h>
+#define VDAGENT_PROBE(name, ...) STAP_PROBEV(spice_vdagent, name, __VA_ARGS__)
+#else
+#define VDAGENT_PROBE(name, ...) do { } while (0)
+#endif
+
+#endif
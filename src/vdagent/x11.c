@@ -55,6 +55,7 @@
 #include <X11/Xlib.h>
 #include <X11/extensions/Xfixes.h>
 #include "vdagentd-proto.h"
+#include "vdagent-probes.h"
 #include "x11.h"
 #include "x11-priv.h"
 
@@ -908,6 +909,7 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
         len = 0;
     }
 
+    VDAGENT_PROBE(x11_clipboard_guest_data, selection, type, len);
     udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
                 data, len);
     vdagent_x11_get_selection_free(x11, data, incr);
@@ -1150,6 +1152,7 @@ static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11)
         return;
     }
 
+    VDAGENT_PROBE(x11_clipboard_guest_request, selection, type);
     udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_REQUEST, selection, type,
                 NULL, 0);
 }
@@ -1215,6 +1218,8 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
     Atom target, clip;
     struct vdagent_x11_conversion_request *req, *new_req;
 
+    VDAGENT_PROBE(x11_clipboard_request, selection, type);
+
     /* We don't use clip here, but we call get_clipboard_atom to verify
        selection is valid */
     if (vdagent_x11_get_clipboard_atom(x11, selection, &clip)) {
@@ -1392,6 +1397,8 @@ void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
     XEvent *event;
     uint32_t type_from_event;
 
+    VDAGENT_PROBE(x11_clipboard_data, selection, type, size);
+
     if (x11->selection_req_data) {
         if (type || size) {
             SELPRINTF("received clipboard data while still sending"
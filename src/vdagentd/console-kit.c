@@ -29,16 +29,26 @@
 #include <syslog.h>
 #include <glib.h>
 
+#include "si-dbus.h"
+
 struct session_info {
     DBusConnection *connection;
-    int fd;
     char *seat;
     char *active_session;
+    gboolean active_session_is_user;
     int verbose;
     gchar *match_seat_signals;
     gchar *match_session_signals;
     gboolean session_is_locked;
     gboolean session_idle_hint;
+
+    /* session that became active, while its type is being queried */
+    char *new_session;
+    DBusPendingCall *active_session_call;
+    DBusPendingCall *session_type_call;
+
+    session_info_changed_callback changed_cb;
+    gpointer changed_data;
 };
 
 #define INTERFACE_CONSOLE_KIT "org.freedesktop.ConsoleKit"
@@ -59,16 +69,16 @@ struct session_info {
 #define SESSION_SIGNAL_IDLE_HINT_CHANGED         "IdleHintChanged"
 
 static char *console_kit_get_first_seat(struct session_info *info);
-static char *console_kit_check_active_session_change(struct session_info *info);
+static void console_kit_request_active_session(struct session_info *info);
 
+/* Match rules are added and removed without waiting for the reply
+ * of the bus, errors are ignored */
 static void si_dbus_match_remove(struct session_info *info)
 {
-    DBusError error;
     if (info->match_seat_signals != NULL) {
-        dbus_error_init(&error);
         dbus_bus_remove_match(info->connection,
                               info->match_seat_signals,
-                              &error);
+                              NULL);
         if (info->verbose)
             syslog(LOG_DEBUG, "(console-kit) seat match removed: %s",
                    info->match_seat_signals);
@@ -76,10 +86,9 @@ static void si_dbus_match_remove(struct session_info *info)
     }
 
     if (info->match_session_signals != NULL) {
-        dbus_error_init(&error);
         dbus_bus_remove_match(info->connection,
                               info->match_session_signals,
-                              &error);
+                              NULL);
 
         if (info->verbose)
             syslog(LOG_DEBUG, "(console-kit) session match removed: %s",
@@ -90,8 +99,6 @@ static void si_dbus_match_remove(struct session_info *info)
 
 static void si_dbus_match_rule_update(struct session_info *info)
 {
-    DBusError error;
-
     if (info->connection == NULL)
         return;
 
@@ -108,16 +115,9 @@ static void si_dbus_match_rule_update(struct session_info *info)
             syslog(LOG_DEBUG, "(console-kit) seat match: %s",
                    info->match_seat_signals);
 
-        dbus_error_init(&error);
         dbus_bus_add_match(info->connection,
                            info->match_seat_signals,
-                           &error);
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_WARNING, "Unable to add dbus rule match: %s",
-                   error.message);
-            dbus_error_free(&error);
-            g_clear_pointer(&info->match_seat_signals, g_free);
-        }
+                           NULL);
     }
 
     /* Session signals */
@@ -130,87 +130,285 @@ static void si_dbus_match_rule_update(struct session_info *info)
             syslog(LOG_DEBUG, "(console-kit) session match: %s",
                    info->match_session_signals);
 
-        dbus_error_init(&error);
         dbus_bus_add_match(info->connection,
                            info->match_session_signals,
-                           &error);
+                           NULL);
+    }
+}
+
+static void si_dbus_cancel_call(DBusPendingCall **call)
+{
+    if (*call != NULL) {
+        dbus_pending_call_cancel(*call);
+        g_clear_pointer(call, dbus_pending_call_unref);
+    }
+}
+
+/* Send @message and call @notify with its reply from the main loop */
+static DBusPendingCall *si_dbus_call(struct session_info *info,
+                                     DBusMessage *message,
+                                     DBusPendingCallNotifyFunction notify)
+{
+    DBusPendingCall *call = NULL;
+
+    if (!dbus_connection_send_with_reply(info->connection, message, &call,
+                                         DBUS_TIMEOUT_USE_DEFAULT) ||
+        call == NULL) {
+        return NULL;
+    }
+    dbus_pending_call_set_notify(call, notify, info, NULL);
+    return call;
+}
+
+/* Returns the reply of @call or NULL, after logging the error */
+static DBusMessage *si_dbus_steal_reply(DBusPendingCall *call,
+                                        const char *method)
+{
+    DBusMessage *reply;
+    DBusError error;
+
+    reply = dbus_pending_call_steal_reply(call);
+    if (reply == NULL) {
+        syslog(LOG_ERR, "%s failed", method);
+        return NULL;
+    }
+
+    dbus_error_init(&error);
+    if (dbus_set_error_from_message(&error, reply)) {
+        syslog(LOG_ERR, "%s failed: %s", method, error.message);
+        dbus_error_free(&error);
+        dbus_message_unref(reply);
+        return NULL;
+    }
+    return reply;
+}
+
+/* Make the session whose type was queried the active one */
+static void console_kit_commit_active_session(struct session_info *info,
+                                              gboolean is_user)
+{
+    g_free(info->active_session);
+    info->active_session = g_steal_pointer(&info->new_session);
+    info->active_session_is_user = is_user;
+    si_dbus_match_rule_update(info);
+
+    if (info->verbose)
+        syslog(LOG_DEBUG, "(console-kit) active-session: '%s'",
+               (info->active_session ? info->active_session : "None"));
+
+    if (info->changed_cb)
+        info->changed_cb(info->changed_data);
+}
+
+static void console_kit_session_type_reply(DBusPendingCall *call,
+                                           void *user_data)
+{
+    struct session_info *info = user_data;
+    DBusMessage *reply;
+    DBusError error;
+    gchar *session_type = NULL;
+    gboolean is_user = TRUE;
+
+    reply = si_dbus_steal_reply(call, "GetSessionType");
+    g_clear_pointer(&info->session_type_call, dbus_pending_call_unref);
+    if (reply == NULL)
+        goto exit;
+
+    dbus_error_init(&error);
+    if (!dbus_message_get_args(reply,
+                               &error,
+                               DBUS_TYPE_STRING, &session_type,
+                               DBUS_TYPE_INVALID)) {
         if (dbus_error_is_set(&error)) {
-            syslog(LOG_WARNING, "Unable to add dbus rule match: %s",
+            syslog(LOG_ERR,
+                   "(console-kit) fail to get session-type from reply: %s",
                    error.message);
             dbus_error_free(&error);
-            g_clear_pointer(&info->match_session_signals, g_free);
+        } else {
+            syslog(LOG_ERR, "(console-kit) fail to get session-type from reply");
         }
+        goto exit;
     }
+
+    /* Empty session_type means user */
+    if (info->verbose)
+        syslog(LOG_DEBUG, "(console-kit) session-type is '%s'", session_type);
+
+    is_user = (g_strcmp0 (session_type, "LoginWindow") != 0);
+
+exit:
+    if (reply != NULL)
+        dbus_message_unref(reply);
+    console_kit_commit_active_session(info, is_user);
+}
+
+/* A new session became active, its type is queried before
+ * it's reported, so that session_info_is_user() is accurate */
+static void console_kit_set_new_session(struct session_info *info,
+                                        const char *session)
+{
+    DBusMessage *message;
+
+    si_dbus_cancel_call(&info->session_type_call);
+    g_free(info->new_session);
+    info->new_session = g_strdup(session);
+
+    if (session == NULL) {
+        console_kit_commit_active_session(info, TRUE);
+        return;
+    }
+
+    message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
+                                           session,
+                                           INTERFACE_CONSOLE_KIT_SESSION,
+                                           "GetSessionType");
+    if (message == NULL) {
+        syslog(LOG_ERR,
+               "(console-kit) Unable to create dbus message for GetSessionType");
+        console_kit_commit_active_session(info, TRUE);
+        return;
+    }
+
+    info->session_type_call = si_dbus_call(info, message,
+                                           console_kit_session_type_reply);
+    dbus_message_unref(message);
+    if (info->session_type_call == NULL) {
+        syslog(LOG_ERR, "GetSessionType failed");
+        console_kit_commit_active_session(info, TRUE);
+    }
+}
+
+static void console_kit_active_session_reply(DBusPendingCall *call,
+                                             void *user_data)
+{
+    struct session_info *info = user_data;
+    DBusMessage *reply;
+    DBusError error;
+    char *session = NULL;
+
+    reply = si_dbus_steal_reply(call, "GetActiveSession");
+    g_clear_pointer(&info->active_session_call, dbus_pending_call_unref);
+    if (reply == NULL)
+        return;
+
+    dbus_error_init(&error);
+    if (!dbus_message_get_args(reply,
+                               &error,
+                               DBUS_TYPE_OBJECT_PATH, &session,
+                               DBUS_TYPE_INVALID)) {
+        if (dbus_error_is_set(&error)) {
+            syslog(LOG_ERR, "error get ssid from reply: %s", error.message);
+            dbus_error_free(&error);
+        } else
+            syslog(LOG_ERR, "error getting ssid from reply");
+    } else {
+        console_kit_set_new_session(info, session);
+    }
+    dbus_message_unref(reply);
+}
+
+static void console_kit_request_active_session(struct session_info *info)
+{
+    DBusMessage *message;
+
+    si_dbus_cancel_call(&info->active_session_call);
+    message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
+                                           info->seat,
+                                           INTERFACE_CONSOLE_KIT_SEAT,
+                                           "GetActiveSession");
+    if (message == NULL) {
+        syslog(LOG_ERR, "Unable to create dbus message");
+        return;
+    }
+
+    info->active_session_call = si_dbus_call(info, message,
+                                             console_kit_active_session_reply);
+    dbus_message_unref(message);
+    if (info->active_session_call == NULL)
+        syslog(LOG_ERR, "GetActiveSession failed");
 }
 
 static void
-si_dbus_read_signals(struct session_info *info)
+si_dbus_active_session_changed(struct session_info *info, DBusMessage *message)
 {
-    DBusMessage *message = NULL;
+    DBusMessageIter iter;
+    gint type;
+    gchar *session;
+
+    /* the signal is more recent than a pending reply */
+    si_dbus_cancel_call(&info->active_session_call);
 
-    dbus_connection_read_write(info->connection, 0);
-    message = dbus_connection_pop_message(info->connection);
-    while (message != NULL) {
-        const char *member;
-
-        member = dbus_message_get_member (message);
-        if (g_strcmp0(member, SEAT_SIGNAL_ACTIVE_SESSION_CHANGED) == 0) {
-            DBusMessageIter iter;
-            gint type;
-            gchar *session;
-
-            g_clear_pointer(&info->active_session, g_free);
-
-            dbus_message_iter_init(message, &iter);
-            type = dbus_message_iter_get_arg_type(&iter);
-            /* Session should be an object path, but there is a bug in
-               ConsoleKit where it sends a string rather than an object_path
-               accept object_path too in case the bug ever gets fixed */
-            if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH) {
-                dbus_message_iter_get_basic(&iter, &session);
-                if (session != NULL && session[0] != '\0') {
-                    info->active_session = g_strdup(session);
-                    si_dbus_match_rule_update(info);
-                } else {
-                    syslog(LOG_WARNING, "(console-kit) received invalid session. "
-                           "No active-session at the moment");
-                }
-            } else {
-                syslog(LOG_ERR,
-                       "ActiveSessionChanged message has unexpected type: '%c'",
-                       type);
-            }
-        } else if (g_strcmp0(member, SESSION_SIGNAL_LOCK) == 0) {
-            info->session_is_locked = TRUE;
-        } else if (g_strcmp0(member, SESSION_SIGNAL_UNLOCK) == 0) {
-            info->session_is_locked = FALSE;
-        } else if (g_strcmp0(member, SESSION_SIGNAL_IDLE_HINT_CHANGED) == 0) {
-            DBusMessageIter iter;
-            gint type;
-            dbus_bool_t idle_hint;
-
-            dbus_message_iter_init(message, &iter);
-            type = dbus_message_iter_get_arg_type(&iter);
-            if (type == DBUS_TYPE_BOOLEAN) {
-                dbus_message_iter_get_basic(&iter, &idle_hint);
-                info->session_idle_hint = (idle_hint);
-            } else {
-                syslog(LOG_ERR,
-                       "(console-kit) IdleHintChanged has unexpected type: '%c'",
-                       type);
-            }
+    dbus_message_iter_init(message, &iter);
+    type = dbus_message_iter_get_arg_type(&iter);
+    /* Session should be an object path, but there is a bug in
+       ConsoleKit where it sends a string rather than an object_path
+       accept object_path too in case the bug ever gets fixed */
+    if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH) {
+        dbus_message_iter_get_basic(&iter, &session);
+        if (session != NULL && session[0] != '\0') {
+            console_kit_set_new_session(info, session);
         } else {
-            if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL) {
-                syslog(LOG_WARNING, "(console-kit) received non signal message");
-            } else if (info->verbose) {
-                syslog(LOG_DEBUG, "(console-kit) Signal not handled: %s", member);
-            }
+            syslog(LOG_WARNING, "(console-kit) received invalid session. "
+                   "No active-session at the moment");
+            console_kit_set_new_session(info, NULL);
         }
+    } else {
+        syslog(LOG_ERR,
+               "ActiveSessionChanged message has unexpected type: '%c'",
+               type);
+        console_kit_set_new_session(info, NULL);
+    }
+}
 
-        dbus_message_unref(message);
-        dbus_connection_read_write(info->connection, 0);
-        message = dbus_connection_pop_message(info->connection);
+static DBusHandlerResult si_dbus_filter(DBusConnection *connection,
+                                        DBusMessage    *message,
+                                        void           *user_data)
+{
+    struct session_info *info = user_data;
+    const char *member;
+
+    if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    member = dbus_message_get_member (message);
+    if (dbus_message_is_signal(message, INTERFACE_CONSOLE_KIT_SEAT,
+                               SEAT_SIGNAL_ACTIVE_SESSION_CHANGED)) {
+        si_dbus_active_session_changed(info, message);
+        return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+    /* session signals only matter for the active session */
+    if (g_strcmp0(dbus_message_get_path(message), info->active_session) != 0)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if (dbus_message_is_signal(message, INTERFACE_CONSOLE_KIT_SESSION,
+                               SESSION_SIGNAL_LOCK)) {
+        info->session_is_locked = TRUE;
+    } else if (dbus_message_is_signal(message, INTERFACE_CONSOLE_KIT_SESSION,
+                                      SESSION_SIGNAL_UNLOCK)) {
+        info->session_is_locked = FALSE;
+    } else if (dbus_message_is_signal(message, INTERFACE_CONSOLE_KIT_SESSION,
+                                      SESSION_SIGNAL_IDLE_HINT_CHANGED)) {
+        DBusMessageIter iter;
+        gint type;
+        dbus_bool_t idle_hint;
+
+        dbus_message_iter_init(message, &iter);
+        type = dbus_message_iter_get_arg_type(&iter);
+        if (type == DBUS_TYPE_BOOLEAN) {
+            dbus_message_iter_get_basic(&iter, &idle_hint);
+            info->session_idle_hint = (idle_hint);
+        } else {
+            syslog(LOG_ERR,
+                   "(console-kit) IdleHintChanged has unexpected type: '%c'",
+                   type);
+        }
+    } else {
+        if (info->verbose)
+            syslog(LOG_DEBUG, "(console-kit) Signal not handled: %s", member);
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
     }
+    return DBUS_HANDLER_RESULT_HANDLED;
 }
 
 struct session_info *session_info_create(int verbose)
@@ -222,6 +420,7 @@ struct session_info *session_info_create(int verbose)
     info->verbose = verbose;
     info->session_is_locked = FALSE;
     info->session_idle_hint = FALSE;
+    info->active_session_is_user = TRUE;
 
     dbus_error_init(&error);
     info->connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error);
@@ -236,18 +435,17 @@ struct session_info *session_info_create(int verbose)
         return NULL;
     }
 
-    if (!dbus_connection_get_unix_fd(info->connection, &info->fd)) {
-        syslog(LOG_ERR, "Unable to get connection fd");
-        session_info_destroy(info);
-        return NULL;
-    }
-
+    /* The seat is looked up synchronously, vdagentd falls back to
+     * running without session info when there's none */
     if (!console_kit_get_first_seat(info)) {
         session_info_destroy(info);
         return NULL;
     }
 
+    dbus_connection_add_filter(info->connection, si_dbus_filter, info, NULL);
+    si_dbus_attach_main_loop(info->connection);
     si_dbus_match_rule_update(info);
+    console_kit_request_active_session(info);
     return info;
 }
 
@@ -256,16 +454,25 @@ void session_info_destroy(struct session_info *info)
     if (!info)
         return;
 
+    si_dbus_cancel_call(&info->active_session_call);
+    si_dbus_cancel_call(&info->session_type_call);
     si_dbus_match_remove(info);
+    si_dbus_detach_main_loop(info->connection);
+    dbus_connection_remove_filter(info->connection, si_dbus_filter, info);
     dbus_connection_close(info->connection);
+    dbus_connection_unref(info->connection);
     g_free(info->seat);
     g_free(info->active_session);
+    g_free(info->new_session);
     g_free(info);
 }
 
-int session_info_get_fd(struct session_info *info)
+void session_info_set_changed_callback(struct session_info *info,
+                                       session_info_changed_callback cb,
+                                       gpointer user_data)
 {
-    return info->fd;
+    info->changed_cb = cb;
+    info->changed_data = user_data;
 }
 
 static char *console_kit_get_first_seat(struct session_info *info)
@@ -335,68 +542,10 @@ exit:
 
 const char *session_info_get_active_session(struct session_info *info)
 {
-    DBusError error;
-    DBusMessage *message = NULL;
-    DBusMessage *reply = NULL;
-    char *session = NULL;
-
     if (!info)
         return NULL;
 
-    if (info->active_session)
-        return console_kit_check_active_session_change(info);
-
-    message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
-                                           info->seat,
-                                           INTERFACE_CONSOLE_KIT_SEAT,
-                                           "GetActiveSession");
-    if (message == NULL) {
-        syslog(LOG_ERR, "Unable to create dbus message");
-        goto exit;
-    }
-
-    dbus_error_init(&error);
-    reply = dbus_connection_send_with_reply_and_block(info->connection,
-                                                      message,
-                                                      -1,
-                                                      &error);
-    if (reply == NULL || dbus_error_is_set(&error)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "GetActiveSession failed: %s", error.message);
-            dbus_error_free(&error);
-        } else
-            syslog(LOG_ERR, "GetActiveSession failed");
-        goto exit;
-    }
-
-    dbus_error_init(&error);
-    if (!dbus_message_get_args(reply,
-                               &error,
-                               DBUS_TYPE_OBJECT_PATH, &session,
-                               DBUS_TYPE_INVALID)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "error get ssid from reply: %s", error.message);
-            dbus_error_free(&error);
-        } else
-            syslog(LOG_ERR, "error getting ssid from reply");
-        session = NULL;
-        goto exit;
-    }
-
-    info->active_session = g_strdup(session);
-    si_dbus_match_rule_update(info);
-
-exit:
-    if (reply != NULL) {
-            dbus_message_unref(reply);
-    }
-
-    if (message != NULL) {
-            dbus_message_unref(message);
-    }
-
-    /* In case the session was changed while we were running */
-    return console_kit_check_active_session_change(info);
+    return info->active_session;
 }
 
 char *session_info_session_for_pid(struct session_info *info, uint32_t pid)
@@ -468,16 +617,6 @@ exit:
     return ssid;
 }
 
-static char *console_kit_check_active_session_change(struct session_info *info)
-{
-    si_dbus_read_signals(info);
-    if (info->verbose)
-        syslog(LOG_DEBUG, "(console-kit) active-session: '%s'",
-               (info->active_session ? info->active_session : "None"));
-
-    return info->active_session;
-}
-
 gboolean session_info_session_is_locked(struct session_info *info)
 {
     gboolean locked;
@@ -489,7 +628,6 @@ gboolean session_info_session_is_locked(struct session_info *info)
      * IdleHintChanged. So use the IdleHint value.
      * systemd-login uses locked-hint which is not implemented in ConsoleKit,
      * see https://github.com/ConsoleKit2/ConsoleKit2/issues/89 */
-    si_dbus_read_signals(info);
     locked = info->session_idle_hint;
     if (info->verbose) {
         syslog(LOG_DEBUG, "(console-kit) session is locked: %s",
@@ -502,71 +640,10 @@ gboolean session_info_session_is_locked(struct session_info *info)
  * in order to verify if active session belongs to user (non greeter) */
 gboolean session_info_is_user(struct session_info *info)
 {
-    DBusError error;
-    DBusMessage *message = NULL;
-    DBusMessage *reply = NULL;
-    gchar *session_type = NULL;
-    gboolean ret = TRUE;
-
     g_return_val_if_fail (info != NULL, TRUE);
-    g_return_val_if_fail (info->connection != NULL, TRUE);
     g_return_val_if_fail (info->active_session != NULL, TRUE);
 
-    message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
-                                           info->active_session,
-                                           INTERFACE_CONSOLE_KIT_SESSION,
-                                           "GetSessionType");
-    if (message == NULL) {
-        syslog(LOG_ERR,
-               "(console-kit) Unable to create dbus message for GetSessionType");
-        return TRUE;
-    }
-
-    dbus_error_init(&error);
-    reply = dbus_connection_send_with_reply_and_block(info->connection,
-                                                      message,
-                                                      -1,
-                                                      &error);
-    if (reply == NULL || dbus_error_is_set(&error)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "GetSessionType failed: %s", error.message);
-            dbus_error_free(&error);
-        } else
-            syslog(LOG_ERR, "GetSessionType failed");
-        goto exit;
-    }
-
-    dbus_error_init(&error);
-    if (!dbus_message_get_args(reply,
-                               &error,
-                               DBUS_TYPE_STRING, &session_type,
-                               DBUS_TYPE_INVALID)) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR,
-                   "(console-kit) fail to get session-type from reply: %s",
-                   error.message);
-            dbus_error_free(&error);
-        } else {
-            syslog(LOG_ERR, "(console-kit) fail to get session-type from reply");
-        }
-        session_type = NULL;
-        goto exit;
-    }
-
-    /* Empty session_type means user */
-    if (info->verbose)
-        syslog(LOG_DEBUG, "(console-kit) session-type is '%s'", session_type);
-
-    ret = (g_strcmp0 (session_type, "LoginWindow") != 0);
-
-exit:
-    if (reply != NULL) {
-        dbus_message_unref(reply);
-    }
-    if (message != NULL) {
-        dbus_message_unref(message);
-    }
-    return ret;
+    return info->active_session_is_user;
 }
 
 uid_t session_info_uid_for_session(struct session_info *info, const char *session)
@@ -31,9 +31,10 @@ void session_info_destroy(struct session_info *si)
 {
 }
 
-int session_info_get_fd(struct session_info *si)
+void session_info_set_changed_callback(struct session_info *si,
+                                       session_info_changed_callback cb,
+                                       gpointer user_data)
 {
-    return -1;
 }
 
 const char *session_info_get_active_session(struct session_info *si)
@@ -0,0 +1,246 @@
+/*  input-thread.c vdagentd input thread
+
+    Copyright 2026 spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <glib.h>
+
+#include "input-thread.h"
+
+/* Bounds of the data handed off to the main loop, in bytes */
+#define HANDOFF_HIGH_MARK (1024 * 1024)
+#define HANDOFF_LOW_MARK  (256 * 1024)
+
+typedef struct {
+    gpointer item;
+    gsize    size;
+} HandoffItem;
+
+struct InputThread {
+    /* only used from the main loop */
+    gint                      ref_count;
+    gboolean                  stopped;
+    GSource                  *handoff_source;
+
+    GMainContext             *context;
+    GThread                  *thread;
+    gint                      quit;
+
+    InputThreadHandoffFunc    handoff_func;
+    GDestroyNotify            item_free;
+    InputThreadCongestionFunc congestion_func;
+    gpointer                  user_data;
+
+    /* only used from the thread */
+    gboolean                  congestion_reported;
+
+    GMutex                    lock;
+    GQueue                    items;
+    gsize                     queued_bytes;
+    gboolean                  congested;
+};
+
+static gboolean handoff_source_dispatch(GSource    *source,
+                                        GSourceFunc callback,
+                                        gpointer    user_data)
+{
+    return callback(user_data);
+}
+
+static GSourceFuncs handoff_source_funcs = {
+    .dispatch = handoff_source_dispatch,
+};
+
+static void input_thread_unref(InputThread *thread)
+{
+    if (--thread->ref_count > 0) {
+        return;
+    }
+    g_source_unref(thread->handoff_source);
+    g_main_context_unref(thread->context);
+    g_mutex_clear(&thread->lock);
+    g_free(thread);
+}
+
+static void handoff_item_free(InputThread *thread, HandoffItem *hitem)
+{
+    thread->item_free(hitem->item);
+    g_free(hitem);
+}
+
+/* Runs in the thread, reports changes of the congestion state */
+static void update_congestion(InputThread *thread)
+{
+    gboolean congested;
+
+    g_mutex_lock(&thread->lock);
+    congested = thread->congested;
+    g_mutex_unlock(&thread->lock);
+
+    if (congested != thread->congestion_reported) {
+        thread->congestion_reported = congested;
+        thread->congestion_func(congested, thread->user_data);
+    }
+}
+
+static gboolean congestion_relieved_cb(gpointer user_data)
+{
+    update_congestion(user_data);
+    return G_SOURCE_REMOVE;
+}
+
+/* The items are taken at once, so that the main loop isn't kept busy
+ * by items which are handed off while the others are being handled */
+static gboolean handoff_dispatch_cb(gpointer user_data)
+{
+    InputThread *thread = user_data;
+    HandoffItem *hitem;
+    GQueue items;
+    gsize handled = 0;
+    gboolean relieved = FALSE;
+
+    g_source_set_ready_time(thread->handoff_source, -1);
+
+    g_mutex_lock(&thread->lock);
+    items = thread->items;
+    g_queue_init(&thread->items);
+    g_mutex_unlock(&thread->lock);
+
+    thread->ref_count++;
+    while ((hitem = g_queue_pop_head(&items))) {
+        if (!thread->stopped) {
+            thread->handoff_func(hitem->item, thread->user_data);
+        }
+        handled += hitem->size;
+        handoff_item_free(thread, hitem);
+    }
+
+    g_mutex_lock(&thread->lock);
+    thread->queued_bytes -= handled;
+    if (thread->congested && thread->queued_bytes <= HANDOFF_LOW_MARK) {
+        thread->congested = FALSE;
+        relieved = TRUE;
+    }
+    g_mutex_unlock(&thread->lock);
+
+    if (relieved && !thread->stopped) {
+        g_main_context_invoke(thread->context, congestion_relieved_cb, thread);
+    }
+    input_thread_unref(thread);
+    return G_SOURCE_CONTINUE;
+}
+
+InputThread *input_thread_new(InputThreadHandoffFunc    handoff_func,
+                              GDestroyNotify            item_free,
+                              InputThreadCongestionFunc congestion_func,
+                              gpointer                  user_data)
+{
+    InputThread *thread = g_new0(InputThread, 1);
+
+    thread->ref_count = 1;
+    thread->context = g_main_context_new();
+    thread->handoff_func = handoff_func;
+    thread->item_free = item_free;
+    thread->congestion_func = congestion_func;
+    thread->user_data = user_data;
+    g_mutex_init(&thread->lock);
+    g_queue_init(&thread->items);
+
+    thread->handoff_source = g_source_new(&handoff_source_funcs, sizeof(GSource));
+    g_source_set_callback(thread->handoff_source, handoff_dispatch_cb,
+                          thread, NULL);
+    g_source_attach(thread->handoff_source, NULL);
+    return thread;
+}
+
+GMainContext *input_thread_get_context(InputThread *thread)
+{
+    return thread->context;
+}
+
+/* The context is owned by the thread while it runs,
+ * see input_thread_is_current() */
+static gpointer input_thread_run(gpointer user_data)
+{
+    InputThread *thread = user_data;
+
+    g_main_context_acquire(thread->context);
+    g_main_context_push_thread_default(thread->context);
+    while (!g_atomic_int_get(&thread->quit)) {
+        g_main_context_iteration(thread->context, TRUE);
+    }
+    g_main_context_pop_thread_default(thread->context);
+    g_main_context_release(thread->context);
+    return NULL;
+}
+
+gboolean input_thread_start(InputThread *thread, GError **err)
+{
+    g_return_val_if_fail(thread->thread == NULL, FALSE);
+
+    thread->thread = g_thread_try_new("vdagentd-input", input_thread_run,
+                                      thread, err);
+    return thread->thread != NULL;
+}
+
+gboolean input_thread_is_current(InputThread *thread)
+{
+    return g_main_context_is_owner(thread->context);
+}
+
+void input_thread_handoff(InputThread *thread, gpointer item, gsize size)
+{
+    HandoffItem *hitem = g_new(HandoffItem, 1);
+    gboolean wakeup;
+
+    hitem->item = item;
+    hitem->size = size;
+
+    g_mutex_lock(&thread->lock);
+    wakeup = g_queue_is_empty(&thread->items);
+    g_queue_push_tail(&thread->items, hitem);
+    thread->queued_bytes += size;
+    if (thread->queued_bytes >= HANDOFF_HIGH_MARK) {
+        thread->congested = TRUE;
+    }
+    g_mutex_unlock(&thread->lock);
+
+    /* the main loop takes all of the queued items at once */
+    if (wakeup) {
+        g_source_set_ready_time(thread->handoff_source, 0);
+    }
+    update_congestion(thread);
+}
+
+void input_thread_destroy(InputThread *thread)
+{
+    HandoffItem *hitem;
+
+    if (thread->thread) {
+        g_atomic_int_set(&thread->quit, TRUE);
+        g_main_context_wakeup(thread->context);
+        g_thread_join(thread->thread);
+        thread->thread = NULL;
+    }
+
+    thread->stopped = TRUE;
+    g_source_destroy(thread->handoff_source);
+    while ((hitem = g_queue_pop_head(&thread->items))) {
+        handoff_item_free(thread, hitem);
+    }
+    input_thread_unref(thread);
+}
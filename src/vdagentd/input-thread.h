@@ -0,0 +1,69 @@
+/*  input-thread.h vdagentd input thread - header
+
+    Copyright 2026 spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENTD_INPUT_THREAD_H
+#define __VDAGENTD_INPUT_THREAD_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A thread iterating its own GMainContext, so that the sources attached
+ * to it are dispatched without waiting for the main loop.
+ * Work the thread can't do itself is handed off to the main loop
+ * as items, which are passed to the handoff func in order. */
+typedef struct InputThread InputThread;
+
+/* Invoked from the main loop for every item handed off by the thread,
+ * the item is freed once the func returns. */
+typedef void (*InputThreadHandoffFunc)(gpointer item, gpointer user_data);
+
+/* Invoked from the thread once the items waiting for the main loop
+ * reach the high water mark (@congested is TRUE) and once they drop
+ * to the low water mark again (@congested is FALSE). */
+typedef void (*InputThreadCongestionFunc)(gboolean congested, gpointer user_data);
+
+InputThread *input_thread_new(InputThreadHandoffFunc    handoff_func,
+                              GDestroyNotify            item_free,
+                              InputThreadCongestionFunc congestion_func,
+                              gpointer                  user_data);
+
+/* Returns the context iterated by the thread. Sources attached to it
+ * before input_thread_start() are dispatched once the thread runs. */
+GMainContext *input_thread_get_context(InputThread *thread);
+
+/* Spawn the thread, returns FALSE when @err is set. */
+gboolean input_thread_start(InputThread *thread, GError **err);
+
+/* Returns TRUE if called from the thread. */
+gboolean input_thread_is_current(InputThread *thread);
+
+/* Hand @item off to the main loop, must be called from the thread.
+ * @size is accounted against the water marks until the item is handled. */
+void input_thread_handoff(InputThread *thread, gpointer item, gsize size);
+
+/* Stop the thread and wait for it to exit. Items which were not passed
+ * to the handoff func yet are freed, sources still attached to the context
+ * are destroyed along with it.
+ *
+ * May be called from the handoff func. */
+void input_thread_destroy(InputThread *thread);
+
+G_END_DECLS
+
+#endif
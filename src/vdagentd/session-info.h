@@ -31,10 +31,18 @@ struct session_info;
 struct session_info *session_info_create(int verbose);
 void session_info_destroy(struct session_info *ck);
 
-int session_info_get_fd(struct session_info *ck);
+/* Called from the main loop when the active session may have changed */
+typedef void (*session_info_changed_callback)(gpointer user_data);
 
+void session_info_set_changed_callback(struct session_info *si,
+                                       session_info_changed_callback cb,
+                                       gpointer user_data);
+
+/* The active session and its lock state are cached, these functions
+ * don't block on the session manager */
 const char *session_info_get_active_session(struct session_info *ck);
-/* Note result must be free()-ed by caller */
+/* Note result must be free()-ed by caller
+ * May block on the session manager, only used when an agent connects */
 char *session_info_session_for_pid(struct session_info *ck, uint32_t pid);
 
 gboolean session_info_session_is_locked(struct session_info *si);
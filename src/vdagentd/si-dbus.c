@@ -0,0 +1,189 @@
+/*  si-dbus.c vdagentd D-Bus main loop integration
+
+    Copyright 2026 spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "si-dbus.h"
+
+typedef struct {
+    DBusConnection *connection;
+    guint dispatch_source;
+} SiDBusDispatch;
+
+/* watches and timeouts store the id of their GSource as data,
+ * 0 while they're disabled */
+static gboolean watch_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    DBusWatch *watch = user_data;
+    unsigned int flags = 0;
+
+    if (condition & G_IO_IN)
+        flags |= DBUS_WATCH_READABLE;
+    if (condition & G_IO_OUT)
+        flags |= DBUS_WATCH_WRITABLE;
+    if (condition & G_IO_ERR)
+        flags |= DBUS_WATCH_ERROR;
+    if (condition & G_IO_HUP)
+        flags |= DBUS_WATCH_HANGUP;
+
+    dbus_watch_handle(watch, flags);
+    return G_SOURCE_CONTINUE;
+}
+
+static void watch_remove(DBusWatch *watch, void *data)
+{
+    guint source_id = GPOINTER_TO_UINT(dbus_watch_get_data(watch));
+
+    if (source_id) {
+        g_source_remove(source_id);
+    }
+    dbus_watch_set_data(watch, NULL, NULL);
+}
+
+static void watch_toggled(DBusWatch *watch, void *data)
+{
+    GIOCondition condition = G_IO_ERR | G_IO_HUP;
+    unsigned int flags;
+    guint source_id = 0;
+
+    watch_remove(watch, data);
+    if (!dbus_watch_get_enabled(watch)) {
+        return;
+    }
+
+    flags = dbus_watch_get_flags(watch);
+    if (flags & DBUS_WATCH_READABLE)
+        condition |= G_IO_IN;
+    if (flags & DBUS_WATCH_WRITABLE)
+        condition |= G_IO_OUT;
+
+    source_id = g_unix_fd_add(dbus_watch_get_unix_fd(watch), condition,
+                              watch_cb, watch);
+    dbus_watch_set_data(watch, GUINT_TO_POINTER(source_id), NULL);
+}
+
+static dbus_bool_t watch_add(DBusWatch *watch, void *data)
+{
+    dbus_watch_set_data(watch, NULL, NULL);
+    watch_toggled(watch, data);
+    return TRUE;
+}
+
+static gboolean timeout_cb(gpointer user_data)
+{
+    dbus_timeout_handle(user_data);
+    return G_SOURCE_CONTINUE;
+}
+
+static void timeout_remove(DBusTimeout *timeout, void *data)
+{
+    guint source_id = GPOINTER_TO_UINT(dbus_timeout_get_data(timeout));
+
+    if (source_id) {
+        g_source_remove(source_id);
+    }
+    dbus_timeout_set_data(timeout, NULL, NULL);
+}
+
+static void timeout_toggled(DBusTimeout *timeout, void *data)
+{
+    guint source_id;
+
+    timeout_remove(timeout, data);
+    if (!dbus_timeout_get_enabled(timeout)) {
+        return;
+    }
+
+    source_id = g_timeout_add(dbus_timeout_get_interval(timeout),
+                              timeout_cb, timeout);
+    dbus_timeout_set_data(timeout, GUINT_TO_POINTER(source_id), NULL);
+}
+
+static dbus_bool_t timeout_add(DBusTimeout *timeout, void *data)
+{
+    dbus_timeout_set_data(timeout, NULL, NULL);
+    timeout_toggled(timeout, data);
+    return TRUE;
+}
+
+static gboolean dispatch_cb(gpointer user_data)
+{
+    SiDBusDispatch *dispatch = user_data;
+
+    dispatch->dispatch_source = 0;
+    while (dbus_connection_dispatch(dispatch->connection) ==
+           DBUS_DISPATCH_DATA_REMAINS);
+    return G_SOURCE_REMOVE;
+}
+
+static void dispatch_status_changed(DBusConnection    *connection,
+                                    DBusDispatchStatus status,
+                                    void              *data)
+{
+    SiDBusDispatch *dispatch = data;
+
+    /* messages must not be dispatched from within libdbus */
+    if (status == DBUS_DISPATCH_DATA_REMAINS && !dispatch->dispatch_source) {
+        dispatch->dispatch_source = g_idle_add(dispatch_cb, dispatch);
+    }
+}
+
+static void dispatch_free(void *data)
+{
+    SiDBusDispatch *dispatch = data;
+
+    if (dispatch->dispatch_source) {
+        g_source_remove(dispatch->dispatch_source);
+    }
+    g_free(dispatch);
+}
+
+void si_dbus_attach_main_loop(DBusConnection *connection)
+{
+    SiDBusDispatch *dispatch;
+
+    dispatch = g_new0(SiDBusDispatch, 1);
+    dispatch->connection = connection;
+    dbus_connection_set_dispatch_status_function(connection,
+                                                 dispatch_status_changed,
+                                                 dispatch, dispatch_free);
+    dbus_connection_set_watch_functions(connection,
+                                        watch_add, watch_remove, watch_toggled,
+                                        NULL, NULL);
+    dbus_connection_set_timeout_functions(connection,
+                                          timeout_add, timeout_remove,
+                                          timeout_toggled, NULL, NULL);
+
+    dispatch_status_changed(connection,
+                            dbus_connection_get_dispatch_status(connection),
+                            dispatch);
+}
+
+void si_dbus_detach_main_loop(DBusConnection *connection)
+{
+    /* libdbus removes the current watches and timeouts
+     * and frees the dispatch data */
+    dbus_connection_set_watch_functions(connection,
+                                        NULL, NULL, NULL, NULL, NULL);
+    dbus_connection_set_timeout_functions(connection,
+                                          NULL, NULL, NULL, NULL, NULL);
+    dbus_connection_set_dispatch_status_function(connection,
+                                                 NULL, NULL, NULL);
+}
@@ -0,0 +1,33 @@
+/*  si-dbus.h vdagentd D-Bus main loop integration - header
+
+    Copyright 2026 spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __SI_DBUS_H
+#define __SI_DBUS_H
+
+#include <dbus/dbus.h>
+
+/* Read, write and dispatch the messages of @connection from the default
+ * GMainContext, so that signals and replies to pending calls are passed
+ * to the filters and notify functions of @connection without blocking. */
+void si_dbus_attach_main_loop(DBusConnection *connection);
+
+/* Stop handling @connection from the main loop,
+ * must be called before @connection is closed. */
+void si_dbus_detach_main_loop(DBusConnection *connection);
+
+#endif
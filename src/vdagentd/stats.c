@@ -0,0 +1,386 @@
+/*  stats.c vdagentd statistics socket
+
+    Copyright 2026 spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+
+#include "vdagent-connection.h"
+#include "stats.h"
+
+#define STATS_WRITER_MAX_DEPTH 8
+/* longest request accepted, "json" or "text" with a line ending */
+#define STATS_REQUEST_MAX 16
+
+struct StatsWriter {
+    GString *out;
+    gboolean json;
+    guint depth;
+    /* no value was written at the depth yet */
+    gboolean first[STATS_WRITER_MAX_DEPTH];
+    /* the next text line starts a list item */
+    gboolean dash;
+};
+
+static void stats_writer_append_json_string(StatsWriter *w, const gchar *s)
+{
+    g_string_append_c(w->out, '"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            g_string_append_c(w->out, '\\');
+            g_string_append_c(w->out, *s);
+        } else if ((guchar)*s < 0x20) {
+            g_string_append_printf(w->out, "\\u%04x", (guchar)*s);
+        } else {
+            g_string_append_c(w->out, *s);
+        }
+    }
+    g_string_append_c(w->out, '"');
+}
+
+/* Starts a value, a group or a list named @name */
+static void stats_writer_begin_item(StatsWriter *w, const gchar *name)
+{
+    guint indent = 2 * (w->depth - 1);
+
+    if (w->json) {
+        if (!w->first[w->depth]) {
+            g_string_append_c(w->out, ',');
+        }
+        w->first[w->depth] = FALSE;
+        if (name) {
+            stats_writer_append_json_string(w, name);
+            g_string_append_c(w->out, ':');
+        }
+        return;
+    }
+
+    if (w->dash) {
+        g_string_append_printf(w->out, "%*s- ", indent - 2, "");
+        w->dash = FALSE;
+    } else {
+        g_string_append_printf(w->out, "%*s", indent, "");
+    }
+    if (name) {
+        g_string_append_printf(w->out, "%s:", name);
+    }
+}
+
+static void stats_writer_push(StatsWriter *w)
+{
+    g_return_if_fail(w->depth + 1 < STATS_WRITER_MAX_DEPTH);
+    w->depth++;
+    w->first[w->depth] = TRUE;
+}
+
+void stats_writer_begin_group(StatsWriter *w, const gchar *name)
+{
+    if (w->json) {
+        stats_writer_begin_item(w, name);
+        g_string_append_c(w->out, '{');
+    } else if (name) {
+        stats_writer_begin_item(w, name);
+        g_string_append_c(w->out, '\n');
+    } else {
+        /* list item, the dash is written with its first value */
+        w->dash = TRUE;
+    }
+    stats_writer_push(w);
+}
+
+void stats_writer_end_group(StatsWriter *w)
+{
+    w->depth--;
+    w->dash = FALSE;
+    if (w->json) {
+        g_string_append_c(w->out, '}');
+    }
+}
+
+void stats_writer_begin_list(StatsWriter *w, const gchar *name)
+{
+    stats_writer_begin_item(w, name);
+    g_string_append_c(w->out, w->json ? '[' : '\n');
+    stats_writer_push(w);
+}
+
+void stats_writer_end_list(StatsWriter *w)
+{
+    w->depth--;
+    if (w->json) {
+        g_string_append_c(w->out, ']');
+    }
+}
+
+void stats_writer_add_uint(StatsWriter *w, const gchar *name, guint64 value)
+{
+    stats_writer_begin_item(w, name);
+    g_string_append_printf(w->out, w->json ? "%" G_GUINT64_FORMAT :
+                           " %" G_GUINT64_FORMAT "\n", value);
+}
+
+void stats_writer_add_bool(StatsWriter *w, const gchar *name, gboolean value)
+{
+    stats_writer_begin_item(w, name);
+    g_string_append_printf(w->out, w->json ? "%s" : " %s\n",
+                           value ? "true" : "false");
+}
+
+void stats_writer_add_string(StatsWriter *w, const gchar *name,
+                             const gchar *value)
+{
+    stats_writer_begin_item(w, name);
+    if (w->json) {
+        stats_writer_append_json_string(w, value ? value : "");
+    } else {
+        g_string_append_printf(w->out, " %s\n", value ? value : "");
+    }
+}
+
+static GBytes *stats_format(StatsWriteFunc write_func, gboolean json)
+{
+    StatsWriter w = { 0, };
+
+    w.out = g_string_new(NULL);
+    w.json = json;
+    w.depth = 1;
+    w.first[1] = TRUE;
+
+    if (json) {
+        g_string_append_c(w.out, '{');
+    }
+    write_func(&w);
+    if (json) {
+        g_string_append(w.out, "}\n");
+    }
+    return g_string_free_to_bytes(w.out);
+}
+
+/* server */
+
+struct StatsServer {
+    GSocketService *service;
+    gchar *path;
+    StatsWriteFunc write_func;
+};
+
+typedef struct {
+    StatsWriteFunc write_func;
+    GSocketConnection *conn;
+    gchar request[STATS_REQUEST_MAX];
+    gsize request_len;
+    GBytes *reply;
+} StatsRequest;
+
+static void stats_request_free(StatsRequest *req)
+{
+    g_io_stream_close(G_IO_STREAM(req->conn), NULL, NULL);
+    g_object_unref(req->conn);
+    g_clear_pointer(&req->reply, g_bytes_unref);
+    g_free(req);
+}
+
+static void stats_request_write_cb(GObject      *source_object,
+                                   GAsyncResult *res,
+                                   gpointer      user_data)
+{
+    StatsRequest *req = user_data;
+    GError *err = NULL;
+
+    if (!g_output_stream_write_all_finish(G_OUTPUT_STREAM(source_object),
+                                          res, NULL, &err)) {
+        syslog(LOG_WARNING, "stats: %s", err->message);
+        g_error_free(err);
+    }
+    stats_request_free(req);
+}
+
+static void stats_request_read(StatsRequest *req);
+
+static void stats_request_reply(StatsRequest *req)
+{
+    GOutputStream *output;
+    gchar *line;
+    gboolean json;
+
+    line = g_strstrip(g_strndup(req->request, req->request_len));
+    json = g_strcmp0(line, "json") == 0;
+    if (!json && g_strcmp0(line, "text") != 0) {
+        syslog(LOG_WARNING, "stats: invalid request");
+        g_free(line);
+        stats_request_free(req);
+        return;
+    }
+    g_free(line);
+
+    req->reply = stats_format(req->write_func, json);
+    output = g_io_stream_get_output_stream(G_IO_STREAM(req->conn));
+    g_output_stream_write_all_async(output,
+                                    g_bytes_get_data(req->reply, NULL),
+                                    g_bytes_get_size(req->reply),
+                                    G_PRIORITY_DEFAULT, NULL,
+                                    stats_request_write_cb, req);
+}
+
+static void stats_request_read_cb(GObject      *source_object,
+                                  GAsyncResult *res,
+                                  gpointer      user_data)
+{
+    StatsRequest *req = user_data;
+    GError *err = NULL;
+    gssize n;
+
+    n = g_input_stream_read_finish(G_INPUT_STREAM(source_object), res, &err);
+    if (n < 0) {
+        syslog(LOG_WARNING, "stats: %s", err->message);
+        g_error_free(err);
+        stats_request_free(req);
+        return;
+    }
+
+    req->request_len += n;
+    /* the request ends with a line ending or when the client shuts down
+     * its side, anything longer than a known request is rejected */
+    if (n == 0 || memchr(req->request, '\n', req->request_len)) {
+        stats_request_reply(req);
+    } else if (req->request_len == sizeof(req->request)) {
+        syslog(LOG_WARNING, "stats: request too long");
+        stats_request_free(req);
+    } else {
+        stats_request_read(req);
+    }
+}
+
+static void stats_request_read(StatsRequest *req)
+{
+    g_input_stream_read_async(g_io_stream_get_input_stream(G_IO_STREAM(req->conn)),
+                              req->request + req->request_len,
+                              sizeof(req->request) - req->request_len,
+                              G_PRIORITY_DEFAULT, NULL,
+                              stats_request_read_cb, req);
+}
+
+static gboolean stats_server_incoming(GSocketService    *service,
+                                      GSocketConnection *conn,
+                                      GObject           *source_object,
+                                      gpointer           user_data)
+{
+    StatsServer *server = user_data;
+    StatsRequest *req;
+
+    req = g_new0(StatsRequest, 1);
+    req->write_func = server->write_func;
+    req->conn = g_object_ref(conn);
+    stats_request_read(req);
+    return TRUE;
+}
+
+StatsServer *stats_server_new(const gchar   *path,
+                              StatsWriteFunc write_func,
+                              GError       **err)
+{
+    StatsServer *server;
+    GSocketAddress *sock_addr;
+    gboolean listening;
+    mode_t mode;
+
+    server = g_new0(StatsServer, 1);
+    server->path = g_strdup(path);
+    server->write_func = write_func;
+    server->service = g_socket_service_new();
+
+    /* remove a socket left behind by a previous instance */
+    unlink(path);
+    mode = umask(0177);
+    sock_addr = g_unix_socket_address_new(path);
+    listening = g_socket_listener_add_address(G_SOCKET_LISTENER(server->service),
+                                              sock_addr,
+                                              G_SOCKET_TYPE_STREAM,
+                                              G_SOCKET_PROTOCOL_DEFAULT,
+                                              NULL, NULL, err);
+    g_object_unref(sock_addr);
+    umask(mode);
+
+    if (!listening) {
+        g_object_unref(server->service);
+        g_free(server->path);
+        g_free(server);
+        return NULL;
+    }
+
+    g_signal_connect(server->service, "incoming",
+                     G_CALLBACK(stats_server_incoming), server);
+    g_socket_service_start(server->service);
+    return server;
+}
+
+void stats_server_destroy(StatsServer *server)
+{
+    if (!server)
+        return;
+
+    g_socket_service_stop(server->service);
+    g_socket_listener_close(G_SOCKET_LISTENER(server->service));
+    g_object_unref(server->service);
+    unlink(server->path);
+    g_free(server->path);
+    g_free(server);
+}
+
+/* client */
+
+int stats_client_run(const gchar *path, gboolean json)
+{
+    const gchar *request = json ? "json\n" : "text\n";
+    GIOStream *stream;
+    GError *err = NULL;
+    gchar buf[4096];
+    gssize n;
+
+    stream = vdagent_socket_connect(path, &err);
+    if (stream == NULL) {
+        goto error;
+    }
+
+    if (!g_output_stream_write_all(g_io_stream_get_output_stream(stream),
+                                   request, strlen(request), NULL, NULL, &err)) {
+        goto error;
+    }
+
+    while ((n = g_input_stream_read(g_io_stream_get_input_stream(stream),
+                                    buf, sizeof(buf), NULL, &err)) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+    if (n < 0) {
+        goto error;
+    }
+
+    g_object_unref(stream);
+    return 0;
+
+error:
+    g_printerr("Could not query %s: %s\n", path, err->message);
+    g_error_free(err);
+    g_clear_object(&stream);
+    return 1;
+}
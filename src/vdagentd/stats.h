@@ -0,0 +1,68 @@
+/*  stats.h vdagentd statistics socket - header
+
+    Copyright 2026 spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENTD_STATS_H
+#define __VDAGENTD_STATS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The statistics socket is a root-only Unix socket next to the agent socket.
+ * A client sends a line with the format it wants ("text" or "json"),
+ * the daemon replies with a snapshot of its statistics and closes
+ * the connection. */
+#define STATS_SOCKET_SUFFIX "-stats"
+
+/* Formats nested groups of named values as indented text or as JSON. */
+typedef struct StatsWriter StatsWriter;
+
+/* Groups are objects in JSON, @name is NULL for the items of a list. */
+void stats_writer_begin_group(StatsWriter *w, const gchar *name);
+void stats_writer_end_group(StatsWriter *w);
+
+/* Lists hold unnamed groups. */
+void stats_writer_begin_list(StatsWriter *w, const gchar *name);
+void stats_writer_end_list(StatsWriter *w);
+
+void stats_writer_add_uint(StatsWriter *w, const gchar *name, guint64 value);
+void stats_writer_add_bool(StatsWriter *w, const gchar *name, gboolean value);
+void stats_writer_add_string(StatsWriter *w, const gchar *name,
+                             const gchar *value);
+
+/* Called for every query, must write the statistics to @w. */
+typedef void (*StatsWriteFunc)(StatsWriter *w);
+
+typedef struct StatsServer StatsServer;
+
+/* Listen on a new socket in @path, accessible only by root.
+ * Returns NULL when @err is set. */
+StatsServer *stats_server_new(const gchar   *path,
+                              StatsWriteFunc write_func,
+                              GError       **err);
+
+/* Stop listening and remove the socket. */
+void stats_server_destroy(StatsServer *server);
+
+/* Query the daemon listening on @path and print its statistics
+ * to stdout. Returns the exit code for the command line tool. */
+int stats_client_run(const gchar *path, gboolean json);
+
+G_END_DECLS
+
+#endif
@@ -26,15 +26,24 @@
 #include <string.h>
 #include <syslog.h>
 #include <systemd/sd-login.h>
+#include <glib-unix.h>
 #include <dbus/dbus.h>
 
+#include "si-dbus.h"
+
 struct session_info {
     int verbose;
     sd_login_monitor *mon;
+    guint mon_source;
+    session_info_changed_callback changed_cb;
+    gpointer changed_data;
     char *session;
     struct {
         DBusConnection *system_connection;
+        char *session_object;
         char *match_session_signals;
+        char *match_properties_changed;
+        DBusPendingCall *locked_hint_call;
     } dbus;
     gboolean session_is_locked;
     gboolean session_locked_hint;
@@ -49,6 +58,7 @@ struct session_info {
 
 #define SESSION_SIGNAL_LOCK         "Lock"
 #define SESSION_SIGNAL_UNLOCK       "Unlock"
+#define PROPERTIES_SIGNAL_CHANGED   "PropertiesChanged"
 
 #define SESSION_PROP_LOCKED_HINT    "LockedHint"
 
@@ -73,74 +83,125 @@ static DBusConnection *si_dbus_get_system_bus(void)
     return connection;
 }
 
+/* Match rules are added and removed without waiting for the reply
+ * of the bus, errors are ignored */
 static void si_dbus_match_remove(struct session_info *si)
 {
-    DBusError error;
-    if (si->dbus.match_session_signals == NULL)
-        return;
-
-    dbus_error_init(&error);
-    dbus_bus_remove_match(si->dbus.system_connection,
-                          si->dbus.match_session_signals,
-                          &error);
-
-    g_clear_pointer(&si->dbus.match_session_signals, g_free);
+    if (si->dbus.match_session_signals != NULL) {
+        dbus_bus_remove_match(si->dbus.system_connection,
+                              si->dbus.match_session_signals, NULL);
+        g_clear_pointer(&si->dbus.match_session_signals, g_free);
+    }
+    if (si->dbus.match_properties_changed != NULL) {
+        dbus_bus_remove_match(si->dbus.system_connection,
+                              si->dbus.match_properties_changed, NULL);
+        g_clear_pointer(&si->dbus.match_properties_changed, g_free);
+    }
+    g_clear_pointer(&si->dbus.session_object, g_free);
 }
 
 static void si_dbus_match_rule_update(struct session_info *si)
 {
-    DBusError error;
-
-    if (si->dbus.system_connection == NULL ||
-            si->session == NULL)
+    if (si->dbus.system_connection == NULL)
         return;
 
     si_dbus_match_remove(si);
+    if (si->session == NULL)
+        return;
 
+    si->dbus.session_object = g_strdup_printf(LOGIND_SESSION_OBJ_TEMPLATE,
+                                              si->session);
     si->dbus.match_session_signals =
-        g_strdup_printf ("type='signal',interface='%s',path='"
-                         LOGIND_SESSION_OBJ_TEMPLATE"'",
+        g_strdup_printf ("type='signal',interface='%s',path='%s'",
                          LOGIND_SESSION_INTERFACE,
-                         si->session);
-    if (si->verbose)
+                         si->dbus.session_object);
+    si->dbus.match_properties_changed =
+        g_strdup_printf ("type='signal',interface='%s',member='%s',path='%s'",
+                         DBUS_PROPERTIES_INTERFACE,
+                         PROPERTIES_SIGNAL_CHANGED,
+                         si->dbus.session_object);
+    if (si->verbose) {
         syslog(LOG_DEBUG, "logind match: %s", si->dbus.match_session_signals);
+        syslog(LOG_DEBUG, "logind match: %s", si->dbus.match_properties_changed);
+    }
 
-    dbus_error_init(&error);
     dbus_bus_add_match(si->dbus.system_connection,
-                       si->dbus.match_session_signals,
-                       &error);
-    if (dbus_error_is_set(&error)) {
-        syslog(LOG_WARNING, "Unable to add dbus rule match: %s",
-               error.message);
-        dbus_error_free(&error);
-        g_clear_pointer(&si->dbus.match_session_signals, g_free);
-    }
+                       si->dbus.match_session_signals, NULL);
+    dbus_bus_add_match(si->dbus.system_connection,
+                       si->dbus.match_properties_changed, NULL);
 }
 
-static void
-si_dbus_read_properties(struct session_info *si)
+/* Reads the boolean in the variant @iter points to into @value */
+static gboolean si_dbus_get_variant_boolean(DBusMessageIter *iter,
+                                            gboolean        *value)
 {
-    dbus_bool_t locked_hint, ret;
-    DBusMessageIter iter, iter_variant;
+    DBusMessageIter iter_variant;
+    dbus_bool_t v;
     gint type;
+
+    type = dbus_message_iter_get_arg_type(iter);
+    if (type != DBUS_TYPE_VARIANT) {
+        syslog(LOG_ERR, "expected a variant, got a '%c' instead", type);
+        return FALSE;
+    }
+
+    dbus_message_iter_recurse(iter, &iter_variant);
+    type = dbus_message_iter_get_arg_type(&iter_variant);
+    if (type != DBUS_TYPE_BOOLEAN) {
+        syslog(LOG_ERR, "expected a boolean, got a '%c' instead", type);
+        return FALSE;
+    }
+    dbus_message_iter_get_basic(&iter_variant, &v);
+    *value = v ? TRUE : FALSE;
+    return TRUE;
+}
+
+static void si_dbus_locked_hint_reply(DBusPendingCall *pending, void *user_data)
+{
+    struct session_info *si = user_data;
+    DBusMessageIter iter;
+    DBusMessage *reply;
     DBusError error;
-    DBusMessage *message = NULL;
-    DBusMessage *reply = NULL;
-    gchar *session_object;
+
+    reply = dbus_pending_call_steal_reply(pending);
+    g_clear_pointer(&si->dbus.locked_hint_call, dbus_pending_call_unref);
+    if (reply == NULL) {
+        syslog(LOG_ERR, "Properties.Get failed (locked-hint)");
+        return;
+    }
+
+    dbus_error_init(&error);
+    if (dbus_set_error_from_message(&error, reply)) {
+        syslog(LOG_ERR, "Properties.Get failed (locked-hint) due %s", error.message);
+        dbus_error_free(&error);
+    } else if (dbus_message_iter_init(reply, &iter)) {
+        si_dbus_get_variant_boolean(&iter, &si->session_locked_hint);
+    }
+    dbus_message_unref(reply);
+}
+
+/* Ask logind for the LockedHint of the active session, the cached value
+ * is updated once the reply arrives */
+static void si_dbus_request_locked_hint(struct session_info *si)
+{
+    DBusMessage *message;
     const gchar *interface, *property;
+    dbus_bool_t ret;
 
-    if (si->session == NULL)
+    if (si->dbus.locked_hint_call != NULL) {
+        dbus_pending_call_cancel(si->dbus.locked_hint_call);
+        g_clear_pointer(&si->dbus.locked_hint_call, dbus_pending_call_unref);
+    }
+    if (si->dbus.system_connection == NULL || si->dbus.session_object == NULL)
         return;
 
-    session_object = g_strdup_printf(LOGIND_SESSION_OBJ_TEMPLATE, si->session);
     message = dbus_message_new_method_call(LOGIND_INTERFACE,
-                                           session_object,
+                                           si->dbus.session_object,
                                            DBUS_PROPERTIES_INTERFACE,
                                            "Get");
-    g_free (session_object);
     if (message == NULL) {
         syslog(LOG_ERR, "Unable to create dbus message");
-        goto exit;
+        return;
     }
 
     interface = LOGIND_SESSION_INTERFACE;
@@ -154,74 +215,94 @@ si_dbus_read_properties(struct session_info *si)
         goto exit;
     }
 
-    dbus_error_init(&error);
-    reply = dbus_connection_send_with_reply_and_block(si->dbus.system_connection,
-                                                      message,
-                                                      -1,
-                                                      &error);
-    if (reply == NULL) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "Properties.Get failed (locked-hint) due %s", error.message);
-            dbus_error_free(&error);
-        } else {
-            syslog(LOG_ERR, "Properties.Get failed (locked-hint)");
-        }
+    if (!dbus_connection_send_with_reply(si->dbus.system_connection, message,
+                                         &si->dbus.locked_hint_call,
+                                         DBUS_TIMEOUT_USE_DEFAULT) ||
+        si->dbus.locked_hint_call == NULL) {
+        syslog(LOG_ERR, "Properties.Get failed (locked-hint)");
         goto exit;
     }
+    dbus_pending_call_set_notify(si->dbus.locked_hint_call,
+                                 si_dbus_locked_hint_reply, si, NULL);
 
-    dbus_message_iter_init(reply, &iter);
-    type = dbus_message_iter_get_arg_type(&iter);
-    if (type != DBUS_TYPE_VARIANT) {
-        syslog(LOG_ERR, "expected a variant, got a '%c' instead", type);
-        goto exit;
-    }
+exit:
+    dbus_message_unref(message);
+}
 
-    dbus_message_iter_recurse(&iter, &iter_variant);
-    type = dbus_message_iter_get_arg_type(&iter_variant);
-    if (type != DBUS_TYPE_BOOLEAN) {
-        syslog(LOG_ERR, "expected a boolean, got a '%c' instead", type);
-        goto exit;
+static void si_dbus_properties_changed(struct session_info *si,
+                                       DBusMessage         *message)
+{
+    DBusMessageIter iter, iter_array, iter_entry;
+    const gchar *interface, *property;
+
+    if (!dbus_message_iter_init(message, &iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING) {
+        return;
+    }
+    dbus_message_iter_get_basic(&iter, &interface);
+    if (g_strcmp0(interface, LOGIND_SESSION_INTERFACE) != 0) {
+        return;
     }
-    dbus_message_iter_get_basic(&iter_variant, &locked_hint);
 
-    si->session_locked_hint = (locked_hint) ? TRUE : FALSE;
-exit:
-    if (reply != NULL) {
-        dbus_message_unref(reply);
+    /* changed properties with their values */
+    if (!dbus_message_iter_next(&iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
+        return;
+    }
+    dbus_message_iter_recurse(&iter, &iter_array);
+    while (dbus_message_iter_get_arg_type(&iter_array) == DBUS_TYPE_DICT_ENTRY) {
+        dbus_message_iter_recurse(&iter_array, &iter_entry);
+        dbus_message_iter_get_basic(&iter_entry, &property);
+        if (g_strcmp0(property, SESSION_PROP_LOCKED_HINT) == 0 &&
+            dbus_message_iter_next(&iter_entry)) {
+            si_dbus_get_variant_boolean(&iter_entry, &si->session_locked_hint);
+        }
+        dbus_message_iter_next(&iter_array);
     }
 
-    if (message != NULL) {
-        dbus_message_unref(message);
+    /* invalidated properties, without their values */
+    if (!dbus_message_iter_next(&iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
+        return;
+    }
+    dbus_message_iter_recurse(&iter, &iter_array);
+    while (dbus_message_iter_get_arg_type(&iter_array) == DBUS_TYPE_STRING) {
+        dbus_message_iter_get_basic(&iter_array, &property);
+        if (g_strcmp0(property, SESSION_PROP_LOCKED_HINT) == 0) {
+            si_dbus_request_locked_hint(si);
+        }
+        dbus_message_iter_next(&iter_array);
     }
 }
 
-static void
-si_dbus_read_signals(struct session_info *si)
+static DBusHandlerResult si_dbus_filter(DBusConnection *connection,
+                                        DBusMessage    *message,
+                                        void           *user_data)
 {
-    DBusMessage *message = NULL;
-
-    dbus_connection_read_write(si->dbus.system_connection, 0);
-    message = dbus_connection_pop_message(si->dbus.system_connection);
-    while (message != NULL) {
-        const char *member;
-
-        member = dbus_message_get_member (message);
-        if (g_strcmp0(member, SESSION_SIGNAL_LOCK) == 0) {
-            si->session_is_locked = TRUE;
-        } else if (g_strcmp0(member, SESSION_SIGNAL_UNLOCK) == 0) {
-            si->session_is_locked = FALSE;
-        } else {
-            if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL) {
-                syslog(LOG_WARNING, "(systemd-login) received non signal message");
-            } else if (si->verbose) {
-                syslog(LOG_DEBUG, "(systemd-login) Signal not handled: %s", member);
-            }
-        }
+    struct session_info *si = user_data;
+    const char *member;
 
-        dbus_message_unref(message);
-        dbus_connection_read_write(si->dbus.system_connection, 0);
-        message = dbus_connection_pop_message(si->dbus.system_connection);
+    if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL ||
+        g_strcmp0(dbus_message_get_path(message), si->dbus.session_object) != 0) {
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
     }
+
+    member = dbus_message_get_member(message);
+    if (dbus_message_is_signal(message, LOGIND_SESSION_INTERFACE,
+                               SESSION_SIGNAL_LOCK)) {
+        si->session_is_locked = TRUE;
+    } else if (dbus_message_is_signal(message, LOGIND_SESSION_INTERFACE,
+                                      SESSION_SIGNAL_UNLOCK)) {
+        si->session_is_locked = FALSE;
+    } else if (dbus_message_is_signal(message, DBUS_PROPERTIES_INTERFACE,
+                                      PROPERTIES_SIGNAL_CHANGED)) {
+        si_dbus_properties_changed(si, message);
+    } else {
+        if (si->verbose)
+            syslog(LOG_DEBUG, "(systemd-login) Signal not handled: %s", member);
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+    return DBUS_HANDLER_RESULT_HANDLED;
 }
 
 struct session_info *session_info_create(int verbose)
@@ -241,6 +322,11 @@ struct session_info *session_info_create(int verbose)
     }
 
     si->dbus.system_connection = si_dbus_get_system_bus();
+    if (si->dbus.system_connection) {
+        dbus_connection_add_filter(si->dbus.system_connection,
+                                   si_dbus_filter, si, NULL);
+        si_dbus_attach_main_loop(si->dbus.system_connection);
+    }
     return si;
 }
 
@@ -249,18 +335,48 @@ void session_info_destroy(struct session_info *si)
     if (!si)
         return;
 
-    si_dbus_match_remove(si);
     if (si->dbus.system_connection) {
+        if (si->dbus.locked_hint_call) {
+            dbus_pending_call_cancel(si->dbus.locked_hint_call);
+            dbus_pending_call_unref(si->dbus.locked_hint_call);
+        }
+        si_dbus_match_remove(si);
+        si_dbus_detach_main_loop(si->dbus.system_connection);
+        dbus_connection_remove_filter(si->dbus.system_connection,
+                                      si_dbus_filter, si);
         dbus_connection_close(si->dbus.system_connection);
+        dbus_connection_unref(si->dbus.system_connection);
     }
+    if (si->mon_source)
+        g_source_remove(si->mon_source);
     sd_login_monitor_unref(si->mon);
     g_free(si->session);
     g_free(si);
 }
 
-int session_info_get_fd(struct session_info *si)
+static gboolean si_login_monitor_cb(gint fd, GIOCondition condition,
+                                    gpointer user_data)
 {
-    return sd_login_monitor_get_fd(si->mon);
+    struct session_info *si = user_data;
+
+    /* the monitor is flushed by session_info_get_active_session() */
+    si->changed_cb(si->changed_data);
+    return G_SOURCE_CONTINUE;
+}
+
+void session_info_set_changed_callback(struct session_info *si,
+                                       session_info_changed_callback cb,
+                                       gpointer user_data)
+{
+    si->changed_cb = cb;
+    si->changed_data = user_data;
+    if (cb && !si->mon_source) {
+        si->mon_source = g_unix_fd_add(sd_login_monitor_get_fd(si->mon),
+                                       G_IO_IN, si_login_monitor_cb, si);
+    } else if (!cb && si->mon_source) {
+        g_source_remove(si->mon_source);
+        si->mon_source = 0;
+    }
 }
 
 const char *session_info_get_active_session(struct session_info *si)
@@ -280,9 +396,17 @@ const char *session_info_get_active_session(struct session_info *si)
         syslog(LOG_INFO, "Active session: %s", si->session);
 
     sd_login_monitor_flush(si->mon);
+
+    /* The lock state of the new session is kept up to date by signals
+     * from logind, starting from its current LockedHint */
+    if (g_strcmp0(old_session, si->session) != 0) {
+        si->session_is_locked = FALSE;
+        si->session_locked_hint = FALSE;
+        si_dbus_match_rule_update(si);
+        si_dbus_request_locked_hint(si);
+    }
     g_free(old_session);
 
-    si_dbus_match_rule_update(si);
     return si->session;
 }
 
@@ -358,10 +482,10 @@ gboolean session_info_session_is_locked(struct session_info *si)
 
     g_return_val_if_fail (si != NULL, FALSE);
 
-    si_dbus_read_signals(si);
-    si_dbus_read_properties(si);
-
-    locked = (si->session_is_locked || si->session_locked_hint);
+    /* until logind replied with the LockedHint of a new session,
+     * it's considered to be locked */
+    locked = (si->session_is_locked || si->session_locked_hint ||
+              si->dbus.locked_hint_call != NULL);
     if (si->verbose) {
         syslog(LOG_DEBUG, "(systemd-login) session is locked: %s",
                locked ? "yes" : "no");
@@ -31,6 +31,20 @@
 #include <spice/vd_agent.h>
 #include <glib.h>
 #include "uinput.h"
+#include "vdagent-probes.h"
+
+/* Range of both axes of a fixed range device */
+#define FIXED_ABS_MAX 32767
+
+/* Display ids are 8 bit in VDAgentMouseState */
+#define MAX_DISPLAY_ID 255
+
+/* Position of a display on the device, indexed by display_id */
+struct uinput_display {
+    gboolean valid;
+    int x;
+    int y;
+};
 
 struct vdagentd_uinput {
     const char *devname;
@@ -40,25 +54,43 @@ struct vdagentd_uinput {
     int height;
     struct vdagentd_guest_xorg_resolution *screen_info;
     int screen_count;
+    struct uinput_display *displays;
+    int display_count;
+    /* 32.32 fixed point factors from the screen to the fixed range */
+    guint64 scale_x;
+    guint64 scale_y;
     VDAgentMouseState last;
     int fake;
+    int fixed_range;
 };
 
+/* Events written to any uinput device since the daemon started */
+static guint64 events_emitted = 0;
+
+static void update_layout(struct vdagentd_uinput *uinput,
+        int width, int height,
+        struct vdagentd_guest_xorg_resolution *screen_info,
+        int screen_count);
+static gboolean open_device(struct vdagentd_uinput *uinput);
+
 struct vdagentd_uinput *vdagentd_uinput_create(const char *devname,
     int width, int height,
     struct vdagentd_guest_xorg_resolution *screen_info, int screen_count,
-    int debug, int fake)
+    int debug, int fake, int fixed_range)
 {
     struct vdagentd_uinput *uinput;
 
     uinput = g_new0(struct vdagentd_uinput, 1);
     uinput->devname = devname;
-    uinput->fd      = -1; /* Gets opened by vdagentd_uinput_update_size() */
+    uinput->fd      = -1;
     uinput->debug   = debug;
     uinput->fake    = fake;
+    uinput->fixed_range = fixed_range;
 
-    vdagentd_uinput_update_size(&uinput, width, height,
-                                screen_info, screen_count);
+    update_layout(uinput, width, height, screen_info, screen_count);
+    if (!open_device(uinput)) {
+        vdagentd_uinput_destroy(&uinput);
+    }
 
     return uinput;
 }
@@ -72,26 +104,78 @@ void vdagentd_uinput_destroy(struct vdagentd_uinput **uinputp)
 
     if (uinput->fd != -1)
         close(uinput->fd);
+    g_free(uinput->screen_info);
+    g_free(uinput->displays);
     g_clear_pointer(uinputp, g_free);
 }
 
-void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
-        int width, int height,
-        struct vdagentd_guest_xorg_resolution *screen_info,
-        int screen_count)
+/* Rebuilds the display table, so that mouse events don't have to search
+ * the screen info */
+static void update_displays(struct vdagentd_uinput *uinput)
 {
-    struct vdagentd_uinput *uinput = *uinputp;
-    struct uinput_user_dev device = {
+    int i, id, count = 0;
+
+    for (i = 0; i < uinput->screen_count; i++) {
+        id = uinput->screen_info[i].display_id;
+        if (id < 0 || id > MAX_DISPLAY_ID) {
+            syslog(LOG_WARNING, "Ignoring screen with display id %d", id);
+            continue;
+        }
+        count = MAX(count, id + 1);
+    }
+
+    g_free(uinput->displays);
+    uinput->displays = g_new0(struct uinput_display, count);
+    uinput->display_count = count;
+
+    for (i = 0; i < uinput->screen_count; i++) {
+        id = uinput->screen_info[i].display_id;
+        if (id < 0 || id > MAX_DISPLAY_ID || uinput->displays[id].valid) {
+            continue;
+        }
+        uinput->displays[id].valid = TRUE;
+        uinput->displays[id].x = uinput->screen_info[i].x;
+        uinput->displays[id].y = uinput->screen_info[i].y;
+    }
+}
+
+/* Rounded up, so that scaling by multiplication gives the same result
+ * as dividing by the screen size for any coordinate on the screen */
+static guint64 scale_factor(int size)
+{
+    return ((guint64)FIXED_ABS_MAX << 32) / MAX(size - 1, 1) + 1;
+}
+
+/* Sets up the range of a fixed range device without the deprecated
+ * uinput_user_dev, returns FALSE if the kernel is too old for that */
+static gboolean setup_fixed_range(struct vdagentd_uinput *uinput)
+{
+#ifdef UI_DEV_SETUP
+    struct uinput_setup setup = {
         .name = "spice vdagent tablet",
-#ifdef WITH_STATIC_UINPUT
-        .absmax  [ ABS_X ] = 32767,
-        .absmax  [ ABS_Y ] = 32767,
+    };
+    struct uinput_abs_setup abs = {
+        .absinfo.maximum = FIXED_ABS_MAX,
+    };
+
+    abs.code = ABS_X;
+    if (ioctl(uinput->fd, UI_ABS_SETUP, &abs) < 0)
+        return FALSE;
+    abs.code = ABS_Y;
+    if (ioctl(uinput->fd, UI_ABS_SETUP, &abs) < 0)
+        return FALSE;
+    return ioctl(uinput->fd, UI_DEV_SETUP, &setup) == 0;
 #else
-        .absmax  [ ABS_X ] = width - 1,
-        .absmax  [ ABS_Y ] = height - 1,
+    return FALSE;
 #endif
-    };
-    int i, rc;
+}
+
+static void update_layout(struct vdagentd_uinput *uinput,
+        int width, int height,
+        struct vdagentd_guest_xorg_resolution *screen_info,
+        int screen_count)
+{
+    int i;
 
     if (uinput->debug) {
         syslog(LOG_DEBUG, "updating uinput size to %dx%d, screen positions:", width, height);
@@ -100,39 +184,38 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         }
     }
 
-    uinput->screen_info  = screen_info;
+    /* copied, as mouse events may be handled while the agent updates it */
+    g_free(uinput->screen_info);
+    uinput->screen_info  = g_memdup2(screen_info,
+                                     screen_count * sizeof(*screen_info));
     uinput->screen_count = screen_count;
-
-    if (uinput->width == width && uinput->height == height)
-        return;
+    update_displays(uinput);
 
     uinput->width  = width;
     uinput->height = height;
+    uinput->scale_x = scale_factor(width);
+    uinput->scale_y = scale_factor(height);
+}
 
-    if (uinput->fd != -1)
-#ifndef WITH_STATIC_UINPUT
-        close(uinput->fd);
-#else
-        return;
-#endif
+/* Opens and sets up the device, returns FALSE on failure */
+static gboolean open_device(struct vdagentd_uinput *uinput)
+{
+    struct uinput_user_dev device = {
+        .name = "spice vdagent tablet",
+        .absmax  [ ABS_X ] = uinput->fixed_range ? FIXED_ABS_MAX : uinput->width - 1,
+        .absmax  [ ABS_Y ] = uinput->fixed_range ? FIXED_ABS_MAX : uinput->height - 1,
+    };
+    int rc;
 
     uinput->fd = open(uinput->devname, uinput->fake ? O_WRONLY : O_RDWR);
     if (uinput->fd == -1) {
         syslog(LOG_ERR, "open %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
-        return;
+        return FALSE;
     }
 
     if (uinput->fake) {
         /* fake device doesn't understand any ioctls and only writes events */
-        return;
-    }
-
-    rc = write(uinput->fd, &device, sizeof(device));
-    if (rc != sizeof(device)) {
-        syslog(LOG_ERR, "write %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
-        return;
+        return TRUE;
     }
 
     /* buttons */
@@ -152,41 +235,79 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     ioctl(uinput->fd, UI_SET_ABSBIT, ABS_X);
     ioctl(uinput->fd, UI_SET_ABSBIT, ABS_Y);
 
+    if (!uinput->fixed_range || !setup_fixed_range(uinput)) {
+        rc = write(uinput->fd, &device, sizeof(device));
+        if (rc != sizeof(device)) {
+            syslog(LOG_ERR, "write %s: %m", uinput->devname);
+            return FALSE;
+        }
+    }
+
     rc = ioctl(uinput->fd, UI_DEV_CREATE);
     if (rc < 0) {
         syslog(LOG_ERR, "create %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
+        return FALSE;
     }
+    return TRUE;
 }
 
-static void uinput_send_event(struct vdagentd_uinput **uinputp,
+gboolean vdagentd_uinput_update_size(struct vdagentd_uinput *uinput,
+        int width, int height,
+        struct vdagentd_guest_xorg_resolution *screen_info,
+        int screen_count)
+{
+    /* a fixed range device stays, only the scaling changes */
+    if (!uinput->fixed_range &&
+        (uinput->width != width || uinput->height != height))
+        return FALSE;
+
+    update_layout(uinput, width, height, screen_info, screen_count);
+    return TRUE;
+}
+
+guint64 vdagentd_uinput_get_events_emitted(void)
+{
+    return __atomic_load_n(&events_emitted, __ATOMIC_RELAXED);
+}
+
+/* Events of a single mouse state: x, y, 5 buttons, 2 wheel and sync */
+#define MAX_MOUSE_EVENTS 10
+
+struct uinput_events {
+    struct input_event events[MAX_MOUSE_EVENTS];
+    int count;
+};
+
+static void uinput_add_event(struct uinput_events *batch,
     __u16 type, __u16 code, __s32 value)
 {
-    struct vdagentd_uinput *uinput = *uinputp;
-    struct input_event event = {
-        .type  = type,
-        .code  = code,
-        .value = value,
-    };
-    int rc;
+    struct input_event *event;
 
-    rc = write(uinput->fd, &event, sizeof(event));
-    if (rc != sizeof(event)) {
-        syslog(LOG_ERR, "write %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
-    }
+    g_return_if_fail(batch->count < MAX_MOUSE_EVENTS);
+
+    VDAGENT_PROBE(uinput_event, type, code, value);
+    event = &batch->events[batch->count++];
+    event->type  = type;
+    event->code  = code;
+    event->value = value;
 }
 
-static struct vdagentd_guest_xorg_resolution* lookup_screen_info(struct vdagentd_uinput *uinput, int display_id)
+/* All events are written at once, the device is destroyed on failure */
+static void uinput_send_events(struct vdagentd_uinput **uinputp,
+    struct uinput_events *batch)
 {
-    int i;
-    for (i = 0; i < uinput->screen_count; i++) {
-        if (uinput->screen_info[i].display_id == display_id) {
-            return &uinput->screen_info[i];
-        }
+    struct vdagentd_uinput *uinput = *uinputp;
+    size_t size = batch->count * sizeof(struct input_event);
+    ssize_t rc;
+
+    rc = write(uinput->fd, batch->events, size);
+    if (rc != (ssize_t)size) {
+        syslog(LOG_ERR, "write %s: %m", uinput->devname);
+        vdagentd_uinput_destroy(uinputp);
+        return;
     }
-    syslog(LOG_WARNING, "Unable to find output index for display id %d", display_id);
-    return NULL;
+    /* written on the input thread, read by the stats on the main one */
+    __atomic_fetch_add(&events_emitted, batch->count, __ATOMIC_RELAXED);
 }
 
 void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
@@ -209,37 +330,41 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         { .name = "up",     .mask =  VD_AGENT_UBUTTON_MASK, .btn = 1  },
         { .name = "down",   .mask =  VD_AGENT_DBUTTON_MASK, .btn = -1 },
     };
+    struct uinput_events batch = { .count = 0 };
+    struct uinput_display *display;
     int i, down;
 
-    if (*uinputp) {
-        struct vdagentd_guest_xorg_resolution *screen_info = lookup_screen_info(uinput, mouse->display_id);
-        if (screen_info == NULL) {
-            syslog(LOG_WARNING, "mouse event for unknown monitor %d",
-                   mouse->display_id);
-            return;
-        }
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
-                   mouse->x, mouse->y);
-        mouse->x += screen_info->x;
-        mouse->y += screen_info->y;
-#ifdef WITH_STATIC_UINPUT
-        mouse->x = mouse->x * 32767 / (uinput->width - 1);
-        mouse->y = mouse->y * 32767 / (uinput->height - 1);
-#endif
+    if (!uinput)
+        return;
+
+    display = mouse->display_id < uinput->display_count ?
+              &uinput->displays[mouse->display_id] : NULL;
+    if (display == NULL || !display->valid) {
+        syslog(LOG_WARNING, "mouse event for unknown monitor %d",
+               mouse->display_id);
+        return;
+    }
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
+               mouse->x, mouse->y);
+    mouse->x += display->x;
+    mouse->y += display->y;
+    if (uinput->fixed_range) {
+        mouse->x = (mouse->x * uinput->scale_x) >> 32;
+        mouse->y = (mouse->y * uinput->scale_y) >> 32;
     }
 
-    if (*uinputp && uinput->last.x != mouse->x) {
+    if (uinput->last.x != mouse->x) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-x %d", mouse->x);
-        uinput_send_event(uinputp, EV_ABS, ABS_X, mouse->x);
+        uinput_add_event(&batch, EV_ABS, ABS_X, mouse->x);
     }
-    if (*uinputp && uinput->last.y != mouse->y) {
+    if (uinput->last.y != mouse->y) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-y %d", mouse->y);
-        uinput_send_event(uinputp, EV_ABS, ABS_Y, mouse->y);
+        uinput_add_event(&batch, EV_ABS, ABS_Y, mouse->y);
     }
-    for (i = 0; i < sizeof(btns)/sizeof(btns[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(btns)/sizeof(btns[0]); i++) {
         if ((uinput->last.buttons & btns[i].mask) ==
                 (mouse->buttons & btns[i].mask))
             continue;
@@ -247,25 +372,24 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: btn-%s %s",
                     btns[i].name, down ? "down" : "up");
-        uinput_send_event(uinputp, EV_KEY, btns[i].btn, down);
+        uinput_add_event(&batch, EV_KEY, btns[i].btn, down);
     }
-    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]); i++) {
         if ((uinput->last.buttons & wheel[i].mask) ==
                 (mouse->buttons & wheel[i].mask))
             continue;
         if (mouse->buttons & wheel[i].mask) {
             if (uinput->debug)
                 syslog(LOG_DEBUG, "mouse: wheel-%s", wheel[i].name);
-            uinput_send_event(uinputp, EV_REL, REL_WHEEL, wheel[i].btn);
+            uinput_add_event(&batch, EV_REL, REL_WHEEL, wheel[i].btn);
         }
     }
 
-    if (*uinputp) {
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse: syn");
-        uinput_send_event(uinputp, EV_SYN, SYN_REPORT, 0);
-    }
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse: syn");
+    uinput_add_event(&batch, EV_SYN, SYN_REPORT, 0);
 
+    uinput_send_events(uinputp, &batch);
     if (*uinputp)
         uinput->last = *mouse;
 }
@@ -23,21 +23,31 @@
 #define __VDAGENTD_UINPUT_H
 
 #include <stdio.h>
+#include <glib.h>
 #include "vdagentd-proto.h"
 
 struct vdagentd_uinput;
 
+/* With @fixed_range the tablet is created once with a fixed range for
+ * both axes, resizing it only changes how coordinates are scaled to it. */
 struct vdagentd_uinput *vdagentd_uinput_create(const char *devname,
     int width, int height,
     struct vdagentd_guest_xorg_resolution *screen_info, int screen_count,
-    int debug, int fake);
+    int debug, int fake, int fixed_range);
 void vdagentd_uinput_destroy(struct vdagentd_uinput **uinputp);
 
 void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         VDAgentMouseState *mouse);
-void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
+/* Updates the screen layout without any I/O, so that it can be called
+ * while holding the lock mouse events are handled with. Returns FALSE
+ * if the size of a device without a fixed range changes, it must then
+ * be replaced by a new one from vdagentd_uinput_create(). */
+gboolean vdagentd_uinput_update_size(struct vdagentd_uinput *uinput,
         int width, int height,
         struct vdagentd_guest_xorg_resolution *screen_info,
         int screen_count);
 
+/* Returns the number of input events written since the daemon started. */
+guint64 vdagentd_uinput_get_events_emitted(void);
+
 #endif
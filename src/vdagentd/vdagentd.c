@@ -43,7 +43,10 @@
 #include "uinput.h"
 #include "xorg-conf.h"
 #include "virtio-port.h"
+#include "input-thread.h"
 #include "session-info.h"
+#include "stats.h"
+#include "vdagentd-proto-strings.h"
 
 #define DEFAULT_UINPUT_DEVICE "/dev/uinput"
 
@@ -55,6 +58,36 @@
 // descriptors for the transfers but the agents do.
 #define MAX_ACTIVE_TRANSFERS 128
 
+// Reading from the virtio port is paused while a session agent has more
+// than AGENT_QUEUE_HIGH_MARK bytes waiting to be written to its socket
+// and resumed once its queue drains to AGENT_QUEUE_LOW_MARK.
+// This way the guest applies flow control to the client, instead of
+// the daemon buffering data for slow agents.
+#define AGENT_QUEUE_HIGH_MARK (1024 * 1024)
+#define AGENT_QUEUE_LOW_MARK  (256 * 1024)
+
+// File transfer data is queued per transfer and passed to the agents
+// round robin, so that a big transfer doesn't hold back the others.
+// At most XFER_IN_FLIGHT_MAX bytes of a single transfer wait in the write
+// queue of an agent connection. Reading from the virtio port is paused
+// while more than XFER_PENDING_HIGH_MARK bytes of all transfers wait
+// in the daemon and resumed once they drop to XFER_PENDING_LOW_MARK.
+#define XFER_IN_FLIGHT_MAX     (128 * 1024)
+#define XFER_PENDING_HIGH_MARK (1024 * 1024)
+#define XFER_PENDING_LOW_MARK  (256 * 1024)
+
+typedef struct {
+    gint ref_count;
+    uint32_t id;
+    UdscsConnection *conn;
+    bool active;            /* false once removed from active_xfers */
+    bool scheduled;         /* true while in xfer_schedule */
+    GQueue pending;         /* data messages not passed to the agent yet */
+    gsize in_flight;        /* bytes in the write queue of the agent */
+    guint64 bytes_received;
+    guint64 bytes_forwarded;
+} FileXfer;
+
 struct agent_data {
     char *session;
     int width;
@@ -71,27 +104,64 @@ static gchar *vdagentd_socket = NULL;
 static gchar *uinput_device = NULL;
 static int debug = 0;
 static gboolean uinput_fake = FALSE;
+#ifdef WITH_STATIC_UINPUT
+static gboolean uinput_fixed_range = TRUE;
+#else
+static gboolean uinput_fixed_range = FALSE;
+#endif
 static gboolean only_once = FALSE;
 static gboolean do_daemonize = TRUE;
 static gboolean want_session_info = TRUE;
+static gboolean mouse_coalescing = TRUE;
+static gboolean stats_query = FALSE;
+static gboolean stats_json = FALSE;
 
 static struct udscs_server *server = NULL;
 static VirtioPort *virtio_port = NULL;
+/* reads virtio_port, passes mouse states to uinput and hands off
+ * the other messages, it only runs while virtio_port is open */
+static InputThread *input_thread = NULL;
+static unsigned int virtio_reconnects = 0;
+static StatsServer *stats_server = NULL;
 static GHashTable *active_xfers = NULL;
 static struct session_info *session_info = NULL;
+/* uinput is used by the input thread, all access is serialized */
+static GMutex uinput_lock;
 static struct vdagentd_uinput *uinput = NULL;
 static VDAgentMonitorsConfig *mon_config = NULL;
-static uint32_t *capabilities = NULL;
-static int capabilities_size = 0;
 static const char *active_session = NULL;
 static unsigned int session_count = 0;
 static UdscsConnection *active_session_conn = NULL;
+/* session id -> agent connection, there's at most one agent per session */
+static GHashTable *session_agents = NULL;
+static unsigned int congested_agents = 0;
+static GQueue xfer_schedule = G_QUEUE_INIT;
+static gsize xfers_pending_bytes = 0;
+static bool xfers_congested = false;
+static guint xfer_schedule_source = 0;
 static bool agent_owns_clipboard[256] = { false, };
 static int retval = 0;
 static bool client_connected = false;
 static int max_clipboard = -1;
 static uint32_t clipboard_serial[256];
 
+/* Mouse state read last, which isn't passed to uinput yet,
+ * only used from the input thread */
+static VDAgentMouseState pending_mouse;
+static bool mouse_pending = false;
+static uint32_t mouse_buttons = 0;
+/* updated on the input thread, read with atomics from the main one */
+static guint64 mouse_states_received = 0;
+static guint64 mouse_states_coalesced = 0;
+
+/* The port read by the input thread and why reading from it is paused:
+ * the main loop congested the agents or the transfers, or it's behind
+ * with the messages handed off to it. Only used from the input thread
+ * while it runs. */
+static VirtioPort *input_port = NULL;
+static bool virtio_read_paused = false;
+static bool client_events_congested = false;
+
 static GMainLoop *loop;
 
 static void agent_data_destroy(struct agent_data *agent_data)
@@ -117,23 +187,131 @@ static void virtio_msg_uint32_to_le(uint8_t *_msg, uint32_t size, uint32_t offse
         msg[i] = GUINT32_TO_LE(msg[i]);
 }
 
-static void virtio_msg_uint32_from_le(uint8_t *_msg, uint32_t size, uint32_t offset)
-{
-    uint32_t i, *msg = (uint32_t *)(_msg + offset);
+/* Layout of the messages received from the client.
+ *
+ * The integer fields listed for each message are converted from little
+ * endian in place, a field with @repeat set is an array that extends
+ * to the end of the message. Offsets and sizes don't include
+ * the selection prefixed to clipboard messages. */
+typedef struct {
+    uint8_t offset;
+    uint8_t width;
+    bool repeat;
+} VDAgentFieldSchema;
+
+enum {
+    SCHEMA_EXACT_SIZE  = 1 << 0, /* size must be equal to the minimal size */
+    SCHEMA_SELECTION   = 1 << 1, /* prefixed by the clipboard selection */
+    SCHEMA_GRAB_SERIAL = 1 << 2, /* starts with the clipboard grab serial */
+};
 
-    /* offset - size % 4 should be 0 - extra bytes are ignored */
-    for (i = 0; i < (size - offset) / 4; i++)
-        msg[i] = GUINT32_FROM_LE(msg[i]);
-}
+typedef struct {
+    uint32_t min_size;
+    uint32_t flags;
+    VDAgentFieldSchema fields[3];
+} VDAgentMessageSchema;
+
+#define FIELD(type, member) \
+    { offsetof(type, member), sizeof(((type *)NULL)->member), false }
+#define ARRAY(type, member, elem_type) \
+    { offsetof(type, member), sizeof(elem_type), true }
 
-static void virtio_msg_uint16_from_le(uint8_t *_msg, uint32_t size, uint32_t offset)
+static const VDAgentMessageSchema vdagent_message_schema[] =
 {
-    uint32_t i;
-    uint16_t *msg = (uint16_t *)(_msg + offset);
+    [VD_AGENT_MOUSE_STATE] = {
+        sizeof(VDAgentMouseState), SCHEMA_EXACT_SIZE,
+        { FIELD(VDAgentMouseState, x), FIELD(VDAgentMouseState, y),
+          FIELD(VDAgentMouseState, buttons) } },
+    [VD_AGENT_MONITORS_CONFIG] = {
+        sizeof(VDAgentMonitorsConfig), 0,
+        { ARRAY(VDAgentMonitorsConfig, num_of_monitors, uint32_t) } },
+    [VD_AGENT_REPLY] = {
+        sizeof(VDAgentReply), SCHEMA_EXACT_SIZE },
+    [VD_AGENT_CLIPBOARD] = {
+        sizeof(VDAgentClipboard), SCHEMA_SELECTION,
+        { FIELD(VDAgentClipboard, type) } },
+    [VD_AGENT_DISPLAY_CONFIG] = {
+        sizeof(VDAgentDisplayConfig), SCHEMA_EXACT_SIZE },
+    [VD_AGENT_ANNOUNCE_CAPABILITIES] = {
+        sizeof(VDAgentAnnounceCapabilities), 0,
+        { ARRAY(VDAgentAnnounceCapabilities, request, uint32_t) } },
+    [VD_AGENT_CLIPBOARD_GRAB] = {
+        sizeof(VDAgentClipboardGrab), SCHEMA_SELECTION | SCHEMA_GRAB_SERIAL,
+        { ARRAY(VDAgentClipboardGrab, types, uint32_t) } },
+    [VD_AGENT_CLIPBOARD_REQUEST] = {
+        sizeof(VDAgentClipboardRequest), SCHEMA_SELECTION | SCHEMA_EXACT_SIZE,
+        { FIELD(VDAgentClipboardRequest, type) } },
+    [VD_AGENT_CLIPBOARD_RELEASE] = {
+        sizeof(VDAgentClipboardRelease), SCHEMA_SELECTION | SCHEMA_EXACT_SIZE },
+    [VD_AGENT_FILE_XFER_START] = {
+        sizeof(VDAgentFileXferStartMessage), 0,
+        { FIELD(VDAgentFileXferStartMessage, id) } },
+    [VD_AGENT_FILE_XFER_STATUS] = {
+        sizeof(VDAgentFileXferStatusMessage), SCHEMA_EXACT_SIZE,
+        { FIELD(VDAgentFileXferStatusMessage, id),
+          FIELD(VDAgentFileXferStatusMessage, result) } },
+    [VD_AGENT_FILE_XFER_DATA] = {
+        sizeof(VDAgentFileXferDataMessage), 0,
+        { FIELD(VDAgentFileXferDataMessage, id),
+          FIELD(VDAgentFileXferDataMessage, size) } },
+    [VD_AGENT_CLIENT_DISCONNECTED] = {
+        0, SCHEMA_EXACT_SIZE },
+    [VD_AGENT_MAX_CLIPBOARD] = {
+        sizeof(VDAgentMaxClipboard), SCHEMA_EXACT_SIZE,
+        { FIELD(VDAgentMaxClipboard, max) } },
+    [VD_AGENT_AUDIO_VOLUME_SYNC] = {
+        sizeof(VDAgentAudioVolumeSync), 0,
+        { ARRAY(VDAgentAudioVolumeSync, volume, uint16_t) } },
+    [VD_AGENT_GRAPHICS_DEVICE_INFO] = {
+        sizeof(VDAgentGraphicsDeviceInfo), 0 },
+};
 
-    /* offset - size % 2 should be 0 - extra bytes are ignored */
-    for (i = 0; i < (size - offset) / 2; i++)
-        msg[i] = GUINT16_FROM_LE(msg[i]);
+/* Features negotiated with the client, computed from its capabilities
+ * whenever they are announced */
+static struct {
+    bool clipboard_by_demand;
+    bool clipboard_selection;
+    bool clipboard_grab_serial;
+    bool file_xfer_detailed_errors;
+    /* sizes of the prefixes of clipboard messages */
+    uint32_t selection_size;
+    uint32_t grab_serial_size;
+    /* minimal body size of each message type, including the prefixes */
+    uint32_t min_size[G_N_ELEMENTS(vdagent_message_schema)];
+} client_features;
+
+static void update_client_features(const VDAgentAnnounceCapabilities *caps,
+                                   int caps_size)
+{
+    const VDAgentMessageSchema *schema;
+    guint type;
+
+    client_features.clipboard_by_demand =
+        VD_AGENT_HAS_CAPABILITY(caps->caps, caps_size,
+                                VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
+    client_features.clipboard_selection =
+        VD_AGENT_HAS_CAPABILITY(caps->caps, caps_size,
+                                VD_AGENT_CAP_CLIPBOARD_SELECTION);
+    client_features.clipboard_grab_serial =
+        VD_AGENT_HAS_CAPABILITY(caps->caps, caps_size,
+                                VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL);
+    client_features.file_xfer_detailed_errors =
+        VD_AGENT_HAS_CAPABILITY(caps->caps, caps_size,
+                                VD_AGENT_CAP_FILE_XFER_DETAILED_ERRORS);
+
+    client_features.selection_size = client_features.clipboard_selection ? 4 : 0;
+    client_features.grab_serial_size = client_features.clipboard_grab_serial ? 4 : 0;
+
+    for (type = 0; type < G_N_ELEMENTS(vdagent_message_schema); type++) {
+        schema = &vdagent_message_schema[type];
+        client_features.min_size[type] = schema->min_size;
+        if (schema->flags & SCHEMA_SELECTION) {
+            client_features.min_size[type] += client_features.selection_size;
+        }
+        if (schema->flags & SCHEMA_GRAB_SERIAL) {
+            client_features.min_size[type] += client_features.grab_serial_size;
+        }
+    }
 }
 
 /* vdagentd <-> spice-client communication handling */
@@ -168,6 +346,12 @@ static void send_capabilities(VirtioPort *vport,
 
 static void do_client_disconnect(void)
 {
+    if (debug) {
+        syslog(LOG_DEBUG, "mouse states: %" G_GUINT64_FORMAT " received, %"
+               G_GUINT64_FORMAT " coalesced",
+               __atomic_load_n(&mouse_states_received, __ATOMIC_RELAXED),
+               __atomic_load_n(&mouse_states_coalesced, __ATOMIC_RELAXED));
+    }
     g_hash_table_remove_all(active_xfers);
     if (client_connected) {
         udscs_server_write_all(server, VDAGENTD_CLIENT_DISCONNECTED, 0, 0,
@@ -176,27 +360,89 @@ static void do_client_disconnect(void)
     }
 }
 
-void do_client_mouse(struct vdagentd_uinput **uinputp, VDAgentMouseState *mouse)
+/* The tablet is only created and replaced by the main loop, the input
+ * thread only destroys it, the lock is not held while setting it up */
+static gboolean reopen_uinput_cb(gpointer user_data)
 {
-    vdagentd_uinput_do_mouse(uinputp, mouse);
-    if (!*uinputp) {
-        /* Try to re-open the tablet */
-        if (active_session_conn) {
-            const struct agent_data *agent_data =
-            g_object_get_data(G_OBJECT(active_session_conn), "agent_data");
-            *uinputp = vdagentd_uinput_create(uinput_device,
-                                              agent_data->width,
-                                              agent_data->height,
-                                              agent_data->screen_info,
-                                              agent_data->screen_count,
-                                              debug > 1,
-                                              uinput_fake);
+    struct vdagentd_uinput *new_uinput = NULL;
+    bool closed, failed;
+
+    g_mutex_lock(&uinput_lock);
+    closed = !uinput;
+    g_mutex_unlock(&uinput_lock);
+
+    /* Try to re-open the tablet, unless the channel got closed meanwhile */
+    if (closed && virtio_port && active_session_conn) {
+        const struct agent_data *agent_data =
+        g_object_get_data(G_OBJECT(active_session_conn), "agent_data");
+        new_uinput = vdagentd_uinput_create(uinput_device,
+                                            agent_data->width,
+                                            agent_data->height,
+                                            agent_data->screen_info,
+                                            agent_data->screen_count,
+                                            debug > 1,
+                                            uinput_fake,
+                                            uinput_fixed_range);
+        g_mutex_lock(&uinput_lock);
+        uinput = new_uinput;
+        g_mutex_unlock(&uinput_lock);
+    }
+    failed = closed && !new_uinput && virtio_port;
+
+    if (failed) {
+        syslog(LOG_CRIT, "Fatal uinput error");
+        vdagentd_quit(1);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* Runs in the input thread, the tablet is re-opened by the main loop
+ * if writing to it fails */
+static void do_client_mouse(VDAgentMouseState *mouse)
+{
+    g_mutex_lock(&uinput_lock);
+    if (uinput) {
+        vdagentd_uinput_do_mouse(&uinput, mouse);
+        if (!uinput) {
+            g_idle_add(reopen_uinput_cb, NULL);
         }
-        if (!*uinputp) {
-            syslog(LOG_CRIT, "Fatal uinput error");
-            vdagentd_quit(1);
+    }
+    g_mutex_unlock(&uinput_lock);
+}
+
+static void flush_client_mouse(void)
+{
+    if (!mouse_pending) {
+        return;
+    }
+    mouse_pending = false;
+    mouse_buttons = pending_mouse.buttons;
+    do_client_mouse(&pending_mouse);
+}
+
+/* Consecutive mouse states which only change the position are collapsed
+ * into the latest one, as long as more messages are queued. Button and
+ * wheel changes are always passed on, in order. */
+static void queue_client_mouse(VDAgentMouseState *mouse)
+{
+    __atomic_fetch_add(&mouse_states_received, 1, __ATOMIC_RELAXED);
+
+    if (!mouse_coalescing) {
+        do_client_mouse(mouse);
+        return;
+    }
+
+    if (mouse_pending) {
+        if (pending_mouse.buttons == mouse_buttons &&
+            mouse->buttons == mouse_buttons &&
+            mouse->display_id == pending_mouse.display_id) {
+            __atomic_fetch_add(&mouse_states_coalesced, 1, __ATOMIC_RELAXED);
+        } else {
+            flush_client_mouse();
         }
     }
+    pending_mouse = *mouse;
+    mouse_pending = true;
 }
 
 static void do_client_monitors(VirtioPort *vport, int port_nr,
@@ -232,24 +478,23 @@ static void do_client_monitors(VirtioPort *vport, int port_nr,
 
 static void do_client_volume_sync(VirtioPort *vport, int port_nr,
     VDAgentMessage *message_header,
-    VDAgentAudioVolumeSync *avs)
+    VDAgentAudioVolumeSync *avs, GBytes *bytes)
 {
     if (active_session_conn == NULL) {
         syslog(LOG_DEBUG, "No active session - Can't volume-sync");
         return;
     }
 
-    udscs_write(active_session_conn, VDAGENTD_AUDIO_VOLUME_SYNC, 0, 0,
-                (uint8_t *)avs, message_header->size);
+    udscs_write_bytes(active_session_conn, VDAGENTD_AUDIO_VOLUME_SYNC, 0, 0,
+                      bytes);
 }
 
 static void do_client_capabilities(VirtioPort *vport,
     VDAgentMessage *message_header,
     VDAgentAnnounceCapabilities *caps)
 {
-    capabilities_size = VD_AGENT_CAPS_SIZE_FROM_MSG_SIZE(message_header->size);
-    g_free(capabilities);
-    capabilities = g_memdup2(caps->caps, capabilities_size * sizeof(uint32_t));
+    update_client_features(caps,
+                           VD_AGENT_CAPS_SIZE_FROM_MSG_SIZE(message_header->size));
 
     if (caps->request) {
         /* Report the previous client has disconnected. */
@@ -263,11 +508,12 @@ static void do_client_capabilities(VirtioPort *vport,
 }
 
 static void do_client_clipboard(VirtioPort *vport,
-    VDAgentMessage *message_header, uint8_t *data)
+    VDAgentMessage *message_header, uint8_t *data, GBytes *bytes)
 {
     uint32_t msg_type = 0, data_type = 0, size = message_header->size;
     uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
     uint32_t serial;
+    GBytes *payload = NULL;
 
     if (!active_session_conn) {
         syslog(LOG_WARNING,
@@ -276,8 +522,7 @@ static void do_client_clipboard(VirtioPort *vport,
         return;
     }
 
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
+    if (client_features.clipboard_selection) {
       selection = data[0];
       data += 4;
       size -= 4;
@@ -285,8 +530,7 @@ static void do_client_clipboard(VirtioPort *vport,
 
     switch (message_header->type) {
     case VD_AGENT_CLIPBOARD_GRAB:
-        if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                    VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)) {
+        if (client_features.clipboard_grab_serial) {
             serial = *(guint32 *)data;
             data += 4;
             size -= 4;
@@ -328,8 +572,168 @@ static void do_client_clipboard(VirtioPort *vport,
         break;
     }
 
-    udscs_write(active_session_conn, msg_type, selection, data_type,
-                data, size);
+    /* the payload is the tail of the message, forward it without copying */
+    if (size > 0) {
+        payload = g_bytes_new_from_bytes(bytes, message_header->size - size, size);
+    }
+    udscs_write_bytes(active_session_conn, msg_type, selection, data_type,
+                      payload);
+    g_clear_pointer(&payload, g_bytes_unref);
+}
+
+static void update_virtio_port_reading(void);
+
+static FileXfer *file_xfer_new(uint32_t id, UdscsConnection *conn)
+{
+    FileXfer *xfer = g_new0(FileXfer, 1);
+
+    xfer->ref_count = 1;
+    xfer->id = id;
+    xfer->conn = g_object_ref(conn);
+    xfer->active = true;
+    g_queue_init(&xfer->pending);
+    return xfer;
+}
+
+static void file_xfer_unref(FileXfer *xfer)
+{
+    if (--xfer->ref_count > 0) {
+        return;
+    }
+    g_object_unref(xfer->conn);
+    g_free(xfer);
+}
+
+static void update_xfers_pending_bytes(gssize delta)
+{
+    bool congested;
+
+    xfers_pending_bytes += delta;
+    if (xfers_congested) {
+        congested = xfers_pending_bytes > XFER_PENDING_LOW_MARK;
+    } else {
+        congested = xfers_pending_bytes >= XFER_PENDING_HIGH_MARK;
+    }
+    if (congested != xfers_congested) {
+        xfers_congested = congested;
+        update_virtio_port_reading();
+    }
+}
+
+/* Drop the data of a transfer which is cancelled or finished,
+ * used as the value destroy function of active_xfers */
+static void file_xfer_remove(gpointer p)
+{
+    FileXfer *xfer = p;
+    gsize dropped = 0;
+    GBytes *bytes;
+
+    while ((bytes = g_queue_pop_head(&xfer->pending))) {
+        dropped += g_bytes_get_size(bytes);
+        g_bytes_unref(bytes);
+    }
+    if (xfer->scheduled) {
+        g_queue_remove(&xfer_schedule, xfer);
+        xfer->scheduled = false;
+    }
+    xfer->active = false;
+    update_xfers_pending_bytes(-(gssize)dropped);
+
+    if (debug) {
+        syslog(LOG_DEBUG, "file-xfer %u: %" G_GUINT64_FORMAT " bytes received, %"
+               G_GUINT64_FORMAT " bytes forwarded", xfer->id,
+               xfer->bytes_received, xfer->bytes_forwarded);
+    }
+    file_xfer_unref(xfer);
+}
+
+static gboolean run_xfer_schedule(gpointer user_data);
+
+typedef struct {
+    FileXfer *xfer;
+    GBytes *bytes;
+} FileXferWrite;
+
+/* Called once the agent connection has written or dropped a data message */
+static void file_xfer_write_done(gpointer p)
+{
+    FileXferWrite *write = p;
+    FileXfer *xfer = write->xfer;
+
+    xfer->in_flight -= g_bytes_get_size(write->bytes);
+    g_bytes_unref(write->bytes);
+    g_free(write);
+
+    /* this runs from within the write path of the connection,
+     * pass on more data from the main loop */
+    if (xfer->scheduled && xfer_schedule_source == 0) {
+        xfer_schedule_source = g_idle_add(run_xfer_schedule, NULL);
+    }
+    file_xfer_unref(xfer);
+}
+
+static void file_xfer_send(FileXfer *xfer)
+{
+    FileXferWrite *write = g_new(FileXferWrite, 1);
+    GBytes *tracked;
+    gsize size;
+
+    write->bytes = g_queue_pop_head(&xfer->pending);
+    write->xfer = xfer;
+    xfer->ref_count++;
+
+    size = g_bytes_get_size(write->bytes);
+    xfer->in_flight += size;
+    xfer->bytes_forwarded += size;
+    update_xfers_pending_bytes(-(gssize)size);
+
+    tracked = g_bytes_new_with_free_func(g_bytes_get_data(write->bytes, NULL),
+                                         size, file_xfer_write_done, write);
+    udscs_write_bytes(xfer->conn, VDAGENTD_FILE_XFER_DATA, 0, 0, tracked);
+    g_bytes_unref(tracked);
+}
+
+/* Pass one data message of each transfer in turn to its agent,
+ * until all transfers are either done or at their in-flight limit */
+static gboolean run_xfer_schedule(gpointer user_data)
+{
+    FileXfer *xfer;
+    guint i, n;
+    bool progress;
+
+    xfer_schedule_source = 0;
+    do {
+        progress = false;
+        n = g_queue_get_length(&xfer_schedule);
+        for (i = 0; i < n; i++) {
+            xfer = g_queue_pop_head(&xfer_schedule);
+            if (xfer->in_flight < XFER_IN_FLIGHT_MAX) {
+                file_xfer_send(xfer);
+                progress = true;
+            }
+            if (g_queue_is_empty(&xfer->pending)) {
+                xfer->scheduled = false;
+            } else {
+                g_queue_push_tail(&xfer_schedule, xfer);
+            }
+        }
+    } while (progress);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void file_xfer_queue_data(FileXfer *xfer, GBytes *bytes)
+{
+    gsize size = g_bytes_get_size(bytes);
+
+    xfer->bytes_received += size;
+    g_queue_push_tail(&xfer->pending, g_bytes_ref(bytes));
+    if (!xfer->scheduled) {
+        g_queue_push_tail(&xfer_schedule, xfer);
+        xfer->scheduled = true;
+    }
+    update_xfers_pending_bytes(size);
+    run_xfer_schedule(NULL);
 }
 
 /* Send file-xfer status to the client. In the case status is an error,
@@ -343,8 +747,7 @@ static void send_file_xfer_status(VirtioPort *vport,
     /* Replace new detailed errors with older generic VD_AGENT_FILE_XFER_STATUS_ERROR
      * when not supported by client */
     if (xfer_status > VD_AGENT_FILE_XFER_STATUS_SUCCESS &&
-        !VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                 VD_AGENT_CAP_FILE_XFER_DETAILED_ERRORS)) {
+        !client_features.file_xfer_detailed_errors) {
         xfer_status = VD_AGENT_FILE_XFER_STATUS_ERROR;
         data_size = 0;
     }
@@ -368,10 +771,10 @@ static void send_file_xfer_status(VirtioPort *vport,
 
 static void do_client_file_xfer(VirtioPort *vport,
                                 VDAgentMessage *message_header,
-                                uint8_t *data)
+                                uint8_t *data, GBytes *bytes)
 {
     uint32_t msg_type, id;
-    UdscsConnection *conn;
+    FileXfer *xfer;
 
     switch (message_header->type) {
     case VD_AGENT_FILE_XFER_START: {
@@ -395,8 +798,7 @@ static void do_client_file_xfer(VirtioPort *vport,
                 GUINT32_TO_LE(G_IO_ERROR_TOO_MANY_OPEN_FILES),
             };
             size_t detail_size = sizeof(error);
-            if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                         VD_AGENT_CAP_FILE_XFER_DETAILED_ERRORS)) {
+            if (!client_features.file_xfer_detailed_errors) {
                 detail_size = 0;
             }
             send_file_xfer_status(vport,
@@ -415,7 +817,8 @@ static void do_client_file_xfer(VirtioPort *vport,
         msg_type = VDAGENTD_FILE_XFER_START;
         id = s->id;
         // associate the id with the active connection
-        g_hash_table_insert(active_xfers, GUINT_TO_POINTER(id), active_session_conn);
+        g_hash_table_insert(active_xfers, GUINT_TO_POINTER(id),
+                            file_xfer_new(id, active_session_conn));
         break;
     }
     case VD_AGENT_FILE_XFER_STATUS: {
@@ -434,13 +837,17 @@ static void do_client_file_xfer(VirtioPort *vport,
         g_return_if_reached(); /* quiet uninitialized variable warning */
     }
 
-    conn = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(id));
-    if (!conn) {
+    xfer = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(id));
+    if (!xfer) {
         if (debug)
             syslog(LOG_DEBUG, "Could not find file-xfer %u (cancelled?)", id);
         return;
     }
-    udscs_write(conn, msg_type, 0, 0, data, message_header->size);
+    if (message_header->type == VD_AGENT_FILE_XFER_DATA) {
+        file_xfer_queue_data(xfer, bytes);
+    } else {
+        udscs_write_bytes(xfer->conn, msg_type, 0, 0, bytes);
+    }
 
     // client told that transfer is ended, agents too stop the transfer
     // and release resources
@@ -449,86 +856,27 @@ static void do_client_file_xfer(VirtioPort *vport,
     }
 }
 
-static void forward_data_to_session_agent(uint32_t type, uint8_t *data, size_t size)
+static void forward_data_to_session_agent(uint32_t type, GBytes *data)
 {
     if (active_session_conn == NULL) {
         syslog(LOG_DEBUG, "No active session, can't forward message (type %u)", type);
         return;
     }
 
-    udscs_write(active_session_conn, type, 0, 0, data, size);
-}
-
-static const gsize vdagent_message_min_size[] =
-{
-    -1, /* Does not exist */
-    sizeof(VDAgentMouseState), /* VD_AGENT_MOUSE_STATE */
-    sizeof(VDAgentMonitorsConfig), /* VD_AGENT_MONITORS_CONFIG */
-    sizeof(VDAgentReply), /* VD_AGENT_REPLY */
-    sizeof(VDAgentClipboard), /* VD_AGENT_CLIPBOARD */
-    sizeof(VDAgentDisplayConfig), /* VD_AGENT_DISPLAY_CONFIG */
-    sizeof(VDAgentAnnounceCapabilities), /* VD_AGENT_ANNOUNCE_CAPABILITIES */
-    sizeof(VDAgentClipboardGrab), /* VD_AGENT_CLIPBOARD_GRAB */
-    sizeof(VDAgentClipboardRequest), /* VD_AGENT_CLIPBOARD_REQUEST */
-    sizeof(VDAgentClipboardRelease), /* VD_AGENT_CLIPBOARD_RELEASE */
-    sizeof(VDAgentFileXferStartMessage), /* VD_AGENT_FILE_XFER_START */
-    sizeof(VDAgentFileXferStatusMessage), /* VD_AGENT_FILE_XFER_STATUS */
-    sizeof(VDAgentFileXferDataMessage), /* VD_AGENT_FILE_XFER_DATA */
-    0, /* VD_AGENT_CLIENT_DISCONNECTED */
-    sizeof(VDAgentMaxClipboard), /* VD_AGENT_MAX_CLIPBOARD */
-    sizeof(VDAgentAudioVolumeSync), /* VD_AGENT_AUDIO_VOLUME_SYNC */
-    sizeof(VDAgentGraphicsDeviceInfo), /* VD_AGENT_GRAPHICS_DEVICE_INFO */
-};
-
-static void vdagent_message_clipboard_from_le(VDAgentMessage *message_header,
-        uint8_t *data)
-{
-    gsize min_size = vdagent_message_min_size[message_header->type];
-    uint32_t *data_type = (uint32_t *) data;
-
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-        min_size += 4;
-        data_type++;
-    }
-
-    switch (message_header->type) {
-    case VD_AGENT_CLIPBOARD_REQUEST:
-    case VD_AGENT_CLIPBOARD:
-        *data_type = GUINT32_FROM_LE(*data_type);
-        break;
-    case VD_AGENT_CLIPBOARD_GRAB:
-        virtio_msg_uint32_from_le(data, message_header->size, min_size);
-        break;
-    case VD_AGENT_CLIPBOARD_RELEASE:
-        break;
-    default:
-        g_warn_if_reached();
-    }
+    udscs_write_bytes(active_session_conn, type, 0, 0, data);
 }
 
-static void vdagent_message_file_xfer_from_le(VDAgentMessage *message_header,
-        uint8_t *data)
+/* Returns the size of the prefix of a message, which isn't described
+ * by its schema */
+static uint32_t vdagent_message_prefix_size(const VDAgentMessageSchema *schema)
 {
-    uint32_t *id = (uint32_t *)data;
-    *id = GUINT32_FROM_LE(*id);
-    id++; /* status */
-
-    switch (message_header->type) {
-    case VD_AGENT_FILE_XFER_DATA: {
-       VDAgentFileXferDataMessage *msg = (VDAgentFileXferDataMessage *)data;
-       msg->size = GUINT64_FROM_LE(msg->size);
-       break;
-    }
-    case VD_AGENT_FILE_XFER_STATUS:
-       *id = GUINT32_FROM_LE(*id); /* status */
-       break;
-    }
+    return (schema->flags & SCHEMA_SELECTION) ? client_features.selection_size : 0;
 }
 
 static gboolean vdagent_message_check_size(const VDAgentMessage *message_header)
 {
-    uint32_t min_size = 0;
+    const VDAgentMessageSchema *schema;
+    uint32_t min_size;
 
     if (message_header->protocol != VD_AGENT_PROTOCOL) {
         syslog(LOG_ERR, "message with wrong protocol version ignoring");
@@ -536,89 +884,97 @@ static gboolean vdagent_message_check_size(const VDAgentMessage *message_header)
     }
 
     if (!message_header->type ||
-        message_header->type >= G_N_ELEMENTS(vdagent_message_min_size)) {
+        message_header->type >= G_N_ELEMENTS(vdagent_message_schema)) {
         syslog(LOG_WARNING, "unknown message type %d, ignoring",
                message_header->type);
         return FALSE;
     }
 
-    min_size = vdagent_message_min_size[message_header->type];
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-        switch (message_header->type) {
-        case VD_AGENT_CLIPBOARD_GRAB:
-        case VD_AGENT_CLIPBOARD_REQUEST:
-        case VD_AGENT_CLIPBOARD:
-        case VD_AGENT_CLIPBOARD_RELEASE:
-          min_size += 4;
-        }
+    schema = &vdagent_message_schema[message_header->type];
+    min_size = client_features.min_size[message_header->type];
+    if ((schema->flags & SCHEMA_EXACT_SIZE) ?
+        message_header->size != min_size : message_header->size < min_size) {
+        syslog(LOG_ERR, "read: invalid message size: %u for message type: %u",
+               message_header->size, message_header->type);
+        return FALSE;
     }
+    return TRUE;
+}
 
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)
-        && message_header->type == VD_AGENT_CLIPBOARD_GRAB) {
-        min_size += 4;
+/* Converts the fields of the first @size bytes of a message, which passed
+ * vdagent_message_check_size(), from little endian in a single pass.
+ * There's nothing to do on little endian hosts. */
+static void vdagent_message_from_le(const VDAgentMessage *message_header,
+                                    uint8_t *data, uint32_t size)
+{
+#if G_BYTE_ORDER != G_LITTLE_ENDIAN
+    const VDAgentMessageSchema *schema =
+        &vdagent_message_schema[message_header->type];
+    const VDAgentFieldSchema *field;
+    uint32_t prefix_size, offset;
+    guint i;
+
+    prefix_size = vdagent_message_prefix_size(schema);
+    if (size < prefix_size) {
+        return;
     }
-
-    switch (message_header->type) {
-    case VD_AGENT_MONITORS_CONFIG:
-    case VD_AGENT_FILE_XFER_START:
-    case VD_AGENT_FILE_XFER_DATA:
-    case VD_AGENT_CLIPBOARD:
-    case VD_AGENT_CLIPBOARD_GRAB:
-    case VD_AGENT_AUDIO_VOLUME_SYNC:
-    case VD_AGENT_ANNOUNCE_CAPABILITIES:
-    case VD_AGENT_GRAPHICS_DEVICE_INFO:
-        if (message_header->size < min_size) {
-            syslog(LOG_ERR, "read: invalid message size: %u for message type: %u",
-                   message_header->size, message_header->type);
-            return FALSE;
-        }
-        break;
-    case VD_AGENT_MOUSE_STATE:
-    case VD_AGENT_FILE_XFER_STATUS:
-    case VD_AGENT_DISPLAY_CONFIG:
-    case VD_AGENT_REPLY:
-    case VD_AGENT_CLIPBOARD_REQUEST:
-    case VD_AGENT_CLIPBOARD_RELEASE:
-    case VD_AGENT_MAX_CLIPBOARD:
-    case VD_AGENT_CLIENT_DISCONNECTED:
-        if (message_header->size != min_size) {
-            syslog(LOG_ERR, "read: invalid message size: %u for message type: %u",
-                   message_header->size, message_header->type);
-            return FALSE;
+    data += prefix_size;
+    size -= prefix_size;
+
+    for (i = 0; i < G_N_ELEMENTS(schema->fields); i++) {
+        field = &schema->fields[i];
+        for (offset = field->offset;
+             field->width && offset + field->width <= size;
+             offset += field->width) {
+            uint16_t u16;
+            uint32_t u32;
+            uint64_t u64;
+
+            switch (field->width) {
+            case 2:
+                memcpy(&u16, data + offset, sizeof(u16));
+                u16 = GUINT16_FROM_LE(u16);
+                memcpy(data + offset, &u16, sizeof(u16));
+                break;
+            case 4:
+                memcpy(&u32, data + offset, sizeof(u32));
+                u32 = GUINT32_FROM_LE(u32);
+                memcpy(data + offset, &u32, sizeof(u32));
+                break;
+            case 8:
+                memcpy(&u64, data + offset, sizeof(u64));
+                u64 = GUINT64_FROM_LE(u64);
+                memcpy(data + offset, &u64, sizeof(u64));
+                break;
+            }
+            if (!field->repeat) {
+                break;
+            }
         }
-        break;
-    default:
-        g_warn_if_reached();
-        return FALSE;
     }
-    return TRUE;
+#endif
 }
 
-static VDAgentGraphicsDeviceInfo *device_info = NULL;
-static size_t device_info_size = 0;
-static void virtio_port_read_complete(
+static GBytes *device_info = NULL;
+static void do_client_message(
         VirtioPort *vport,
         int port_nr,
         VDAgentMessage *message_header,
-        uint8_t *data)
+        GBytes *bytes)
 {
+    /* the body isn't shared yet, it's converted in place */
+    uint8_t *data = (uint8_t *)g_bytes_get_data(bytes, NULL);
+
     if (!vdagent_message_check_size(message_header))
         return;
+    vdagent_message_from_le(message_header, data, message_header->size);
 
     switch (message_header->type) {
-    case VD_AGENT_MOUSE_STATE:
-        virtio_msg_uint32_from_le(data, message_header->size, 0);
-        do_client_mouse(&uinput, (VDAgentMouseState *)data);
-        break;
     case VD_AGENT_MONITORS_CONFIG:
-        virtio_msg_uint32_from_le(data, message_header->size, 0);
         do_client_monitors(vport, port_nr, message_header,
                     (VDAgentMonitorsConfig *)data);
         break;
     case VD_AGENT_ANNOUNCE_CAPABILITIES:
-        virtio_msg_uint32_from_le(data, message_header->size, 0);
         do_client_capabilities(vport, message_header,
                         (VDAgentAnnounceCapabilities *)data);
         break;
@@ -626,38 +982,95 @@ static void virtio_port_read_complete(
     case VD_AGENT_CLIPBOARD_REQUEST:
     case VD_AGENT_CLIPBOARD:
     case VD_AGENT_CLIPBOARD_RELEASE:
-        vdagent_message_clipboard_from_le(message_header, data);
-        do_client_clipboard(vport, message_header, data);
+        do_client_clipboard(vport, message_header, data, bytes);
         break;
     case VD_AGENT_FILE_XFER_START:
     case VD_AGENT_FILE_XFER_STATUS:
     case VD_AGENT_FILE_XFER_DATA:
-        vdagent_message_file_xfer_from_le(message_header, data);
-        do_client_file_xfer(vport, message_header, data);
+        do_client_file_xfer(vport, message_header, data, bytes);
         break;
     case VD_AGENT_CLIENT_DISCONNECTED:
-        vdagent_virtio_port_reset(vport, VDP_CLIENT_PORT);
+        /* the port was reset by the input thread */
         do_client_disconnect();
         break;
     case VD_AGENT_MAX_CLIPBOARD: {
-        max_clipboard = GUINT32_FROM_LE(((VDAgentMaxClipboard *)data)->max);
+        max_clipboard = ((VDAgentMaxClipboard *)data)->max;
         syslog(LOG_DEBUG, "Set max clipboard: %d", max_clipboard);
         break;
     }
     case VD_AGENT_GRAPHICS_DEVICE_INFO: {
         // store device info for re-sending when a session agent reconnects
-        g_free(device_info);
-        device_info = g_memdup2(data, message_header->size);
-        device_info_size = message_header->size;
-        forward_data_to_session_agent(VDAGENTD_GRAPHICS_DEVICE_INFO, data, message_header->size);
+        g_clear_pointer(&device_info, g_bytes_unref);
+        device_info = g_bytes_ref(bytes);
+        forward_data_to_session_agent(VDAGENTD_GRAPHICS_DEVICE_INFO, device_info);
         break;
     }
     case VD_AGENT_AUDIO_VOLUME_SYNC: {
         VDAgentAudioVolumeSync *vdata = (VDAgentAudioVolumeSync *)data;
-        virtio_msg_uint16_from_le((uint8_t *)vdata, message_header->size,
-            offsetof(VDAgentAudioVolumeSync, volume));
+        do_client_volume_sync(vport, port_nr, message_header, vdata, bytes);
+        break;
+    }
+    default:
+        /* mouse states are handled by the input thread */
+        g_warn_if_reached();
+    }
+}
+
+/* Clipboard data spanning several chunks is collected without copying it
+ * as it's received, once the fields needed to route it are known, and
+ * forwarded to the session agent when complete. A message cut short is
+ * dropped. File transfer data isn't streamed, it's passed to
+ * the scheduler as whole messages. */
+static struct {
+    bool active;
+    VDAgentMessage header;
+    uint8_t prefix[4 + sizeof(VDAgentClipboard)];
+    uint32_t prefix_size;
+    uint32_t prefix_read;
+    UdscsConnection *conn;
+} client_stream;
+
+static void client_stream_begin(VDAgentMessage *message_header)
+{
+    /* invalid messages are dropped */
+    if (!vdagent_message_check_size(message_header)) {
+        return;
+    }
+
+    client_stream.active = true;
+    client_stream.header = *message_header;
+    client_stream.prefix_size = client_features.min_size[message_header->type];
+    client_stream.prefix_read = 0;
+}
+
+static void client_stream_start(void)
+{
+    VDAgentMessage *header = &client_stream.header;
+    uint8_t *data = client_stream.prefix;
+
+    switch (header->type) {
+    case VD_AGENT_CLIPBOARD: {
+        uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+        VDAgentClipboard *clipboard;
+
+        if (!active_session_conn) {
+            syslog(LOG_WARNING,
+                   "Could not find an agent connection belonging to the "
+                   "active session, ignoring client clipboard data");
+            return;
+        }
 
-        do_client_volume_sync(vport, port_nr, message_header, vdata);
+        vdagent_message_from_le(header, data, client_stream.prefix_size);
+        if (client_features.clipboard_selection) {
+            selection = data[0];
+            data += 4;
+        }
+        clipboard = (VDAgentClipboard *)data;
+
+        client_stream.conn = g_object_ref(active_session_conn);
+        udscs_write_start(client_stream.conn, VDAGENTD_CLIPBOARD_DATA,
+                          selection, clipboard->type,
+                          header->size - client_stream.prefix_size);
         break;
     }
     default:
@@ -665,78 +1078,385 @@ static void virtio_port_read_complete(
     }
 }
 
-static void virtio_port_error_cb(VDAgentConnection *conn, GError *err)
+static void client_stream_data(GBytes *bytes)
+{
+    gsize size;
+    const uint8_t *data = g_bytes_get_data(bytes, &size);
+    uint32_t n = 0;
+
+    if (!client_stream.active) {
+        return;
+    }
+
+    if (client_stream.prefix_read < client_stream.prefix_size) {
+        n = MIN(size, client_stream.prefix_size - client_stream.prefix_read);
+        memcpy(client_stream.prefix + client_stream.prefix_read, data, n);
+        client_stream.prefix_read += n;
+
+        if (client_stream.prefix_read < client_stream.prefix_size) {
+            return;
+        }
+        client_stream_start();
+    }
+
+    if (client_stream.conn && n < size) {
+        /* the rest is queued without copying it out of the read buffer */
+        bytes = g_bytes_new_from_bytes(bytes, n, size - n);
+        udscs_write_append_bytes(client_stream.conn, bytes);
+        g_bytes_unref(bytes);
+    }
+}
+
+static void client_stream_end(gboolean complete)
+{
+    if (!client_stream.active) {
+        return;
+    }
+    client_stream.active = false;
+
+    if (!complete) {
+        syslog(LOG_WARNING, "client message (type %u) was not fully received",
+               client_stream.header.type);
+    }
+    if (client_stream.conn) {
+        udscs_write_end(client_stream.conn);
+        g_clear_object(&client_stream.conn);
+    }
+}
+
+/* Messages, stream fragments and errors of the virtio port,
+ * handed off by the input thread to the main loop in order */
+typedef enum {
+    CLIENT_EVENT_MESSAGE,
+    CLIENT_EVENT_STREAM_BEGIN,
+    CLIENT_EVENT_STREAM_DATA,
+    CLIENT_EVENT_STREAM_END,
+    CLIENT_EVENT_ERROR,
+} ClientEventType;
+
+typedef struct {
+    ClientEventType type;
+    int port_nr;
+    VDAgentMessage header;  /* MESSAGE and STREAM_BEGIN */
+    GBytes *bytes;          /* MESSAGE and STREAM_DATA */
+    gboolean complete;      /* STREAM_END */
+    GError *err;            /* ERROR */
+} ClientEvent;
+
+static ClientEvent *client_event_new(ClientEventType type, int port_nr)
+{
+    ClientEvent *event = g_new0(ClientEvent, 1);
+
+    event->type = type;
+    event->port_nr = port_nr;
+    return event;
+}
+
+static void client_event_free(gpointer p)
+{
+    ClientEvent *event = p;
+
+    g_clear_pointer(&event->bytes, g_bytes_unref);
+    g_clear_error(&event->err);
+    g_free(event);
+}
+
+/* Runs in the input thread. Once the thread is stopped, the events
+ * reported by the port while it's destroyed are dropped. */
+static void client_event_push(ClientEvent *event, gsize size)
+{
+    if (input_thread == NULL) {
+        client_event_free(event);
+        return;
+    }
+    input_thread_handoff(input_thread, event, size);
+}
+
+static void virtio_port_error(GError *err);
+
+static void client_event_handoff(gpointer item, gpointer user_data)
+{
+    ClientEvent *event = item;
+
+    switch (event->type) {
+    case CLIENT_EVENT_MESSAGE:
+        do_client_message(virtio_port, event->port_nr, &event->header,
+                          event->bytes);
+        break;
+    case CLIENT_EVENT_STREAM_BEGIN:
+        client_stream_begin(&event->header);
+        break;
+    case CLIENT_EVENT_STREAM_DATA:
+        client_stream_data(event->bytes);
+        break;
+    case CLIENT_EVENT_STREAM_END:
+        client_stream_end(event->complete);
+        break;
+    case CLIENT_EVENT_ERROR:
+        virtio_port_error(g_steal_pointer(&event->err));
+        break;
+    }
+}
+
+/* Runs in the input thread, mouse states are passed to uinput right away,
+ * everything else is handed off to the main loop */
+static void virtio_port_read_complete(
+        VirtioPort *vport,
+        int port_nr,
+        VDAgentMessage *message_header,
+        uint8_t *data)
+{
+    ClientEvent *event;
+
+    if (message_header->type == VD_AGENT_MOUSE_STATE &&
+        message_header->protocol == VD_AGENT_PROTOCOL &&
+        message_header->size == sizeof(VDAgentMouseState)) {
+        vdagent_message_from_le(message_header, data, message_header->size);
+        queue_client_mouse((VDAgentMouseState *)data);
+        return;
+    }
+
+    /* keep the order of mouse states and other messages */
+    flush_client_mouse();
+
+    if (message_header->type == VD_AGENT_CLIENT_DISCONNECTED) {
+        vdagent_virtio_port_reset(vport, VDP_CLIENT_PORT);
+    }
+
+    event = client_event_new(CLIENT_EVENT_MESSAGE, port_nr);
+    event->header = *message_header;
+    event->bytes = vdagent_virtio_port_get_message_bytes(vport);
+    client_event_push(event, message_header->size);
+}
+
+static gboolean virtio_port_stream_begin(VirtioPort *vport, int port_nr,
+                                         VDAgentMessage *message_header)
+{
+    ClientEvent *event;
+
+    if (port_nr != VDP_CLIENT_PORT) {
+        return FALSE;
+    }
+    if (message_header->type != VD_AGENT_CLIPBOARD) {
+        return FALSE;
+    }
+
+    flush_client_mouse();
+    event = client_event_new(CLIENT_EVENT_STREAM_BEGIN, port_nr);
+    event->header = *message_header;
+    client_event_push(event, 0);
+    return TRUE;
+}
+
+static void virtio_port_stream_data(VirtioPort *vport, int port_nr,
+                                    GBytes *data)
+{
+    ClientEvent *event;
+
+    event = client_event_new(CLIENT_EVENT_STREAM_DATA, port_nr);
+    event->bytes = g_bytes_ref(data);
+    client_event_push(event, g_bytes_get_size(data));
+}
+
+static void virtio_port_stream_end(VirtioPort *vport, int port_nr,
+                                   gboolean complete)
+{
+    ClientEvent *event;
+
+    event = client_event_new(CLIENT_EVENT_STREAM_END, port_nr);
+    event->complete = complete;
+    client_event_push(event, 0);
+}
+
+static void virtio_port_error_cb(VDAgentConnection *conn, GError *err);
+
+static void virtio_port_messages_done(VirtioPort *vport)
+{
+    flush_client_mouse();
+}
+
+/* Runs in the input thread */
+static void update_input_reading(void)
+{
+    vdagent_connection_set_read_paused(VDAGENT_CONNECTION(input_port),
+                                       virtio_read_paused ||
+                                       client_events_congested);
+}
+
+static void client_events_congestion_cb(gboolean congested, gpointer user_data)
+{
+    if (debug) {
+        syslog(LOG_DEBUG, "main loop %s with the client messages",
+               congested ? "is behind" : "caught up");
+    }
+    client_events_congested = congested;
+    update_input_reading();
+}
+
+static gboolean set_virtio_read_paused_cb(gpointer user_data)
+{
+    virtio_read_paused = GPOINTER_TO_UINT(user_data);
+    update_input_reading();
+    return G_SOURCE_REMOVE;
+}
+
+/* Opens the virtio port along with the input thread reading from it */
+static VirtioPort *virtio_port_create(void)
+{
+    VirtioPort *vport;
+    GError *err = NULL;
+
+    input_thread = input_thread_new(client_event_handoff, client_event_free,
+                                    client_events_congestion_cb, NULL);
+    vport = vdagent_virtio_port_create(portdev,
+                                       input_thread_get_context(input_thread),
+                                       virtio_port_read_complete,
+                                       virtio_port_error_cb);
+    if (vport == NULL) {
+        input_thread_destroy(input_thread);
+        input_thread = NULL;
+        return NULL;
+    }
+
+    vdagent_virtio_port_set_stream_callbacks(vport,
+                                             virtio_port_stream_begin,
+                                             virtio_port_stream_data,
+                                             virtio_port_stream_end);
+    vdagent_virtio_port_set_messages_done_callback(vport,
+                                                   virtio_port_messages_done);
+
+    input_port = vport;
+    virtio_read_paused = false;
+    client_events_congested = false;
+    if (!input_thread_start(input_thread, &err)) {
+        syslog(LOG_ERR, "%s: %s", __func__, err->message);
+        g_error_free(err);
+        input_thread_destroy(input_thread);
+        input_thread = NULL;
+        input_port = NULL;
+        vdagent_connection_destroy(vport);
+        return NULL;
+    }
+    return vport;
+}
+
+/* Stops the input thread before the port is destroyed, the messages
+ * which weren't handled yet are dropped along with the port.
+ * input_thread is only cleared once the thread is gone, as it's used
+ * by the thread itself. */
+static void virtio_port_close(void)
+{
+    if (input_thread) {
+        input_thread_destroy(input_thread);
+        input_thread = NULL;
+        input_port = NULL;
+    }
+    g_clear_pointer(&virtio_port, vdagent_connection_destroy);
+    client_stream_end(FALSE);
+}
+
+static void update_virtio_port_reading(void)
+{
+    if (input_thread) {
+        g_main_context_invoke(input_thread_get_context(input_thread),
+                              set_virtio_read_paused_cb,
+                              GUINT_TO_POINTER(congested_agents > 0 ||
+                                               xfers_congested));
+    }
+}
+
+static void agent_watermark_cb(VDAgentConnection *conn, gboolean congested)
+{
+    if (congested) {
+        congested_agents++;
+    } else {
+        congested_agents--;
+    }
+    if (debug) {
+        syslog(LOG_DEBUG, "agent write queue %s, %u congested agent(s)",
+               congested ? "full" : "drained", congested_agents);
+    }
+    update_virtio_port_reading();
+}
+
+static void virtio_port_error(GError *err)
 {
     bool old_client_connected = client_connected;
     syslog(LOG_CRIT, "AIIEEE lost spice client connection, reconnecting (err: %s)",
                      err ? err->message : "");
     g_clear_error(&err);
 
-    vdagent_connection_destroy(virtio_port);
-    virtio_port = vdagent_virtio_port_create(portdev,
-                                             virtio_port_read_complete,
-                                             virtio_port_error_cb);
+    virtio_reconnects++;
+    virtio_port_close();
+    virtio_port = virtio_port_create();
     if (virtio_port == NULL) {
         syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
         vdagentd_quit(1);
         return;
     }
+    update_virtio_port_reading();
     do_client_disconnect();
     client_connected = old_client_connected;
 }
 
-static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
-    uint32_t data_type, uint8_t *data, uint32_t data_size)
+/* Read errors are reported by the input thread, these are handled once
+ * the messages read before are, the port doesn't read anything further */
+static void virtio_port_error_cb(VDAgentConnection *conn, GError *err)
 {
-    uint32_t size = data_size;
+    ClientEvent *event;
 
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-        size += 4;
-    }
-    if (msg_type == VD_AGENT_CLIPBOARD_GRAB
-        && VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                   VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)) {
-        size += sizeof(uint32_t);
-    }
-    if (data_type != -1) {
-        size += 4;
+    if (input_thread && input_thread_is_current(input_thread)) {
+        vdagent_connection_stop_reading(conn);
+        event = client_event_new(CLIENT_EVENT_ERROR, 0);
+        event->err = err;
+        client_event_push(event, 0);
+        return;
     }
+    virtio_port_error(err);
+}
 
-    vdagent_virtio_port_write_start(virtio_port, VDP_CLIENT_PORT, msg_type,
-                                    0, size);
+static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
+    uint32_t data_type, uint8_t *data, uint32_t data_size)
+{
+    /* selection, data type and grab serial */
+    uint8_t header[12];
+    uint32_t header_size = client_features.selection_size;
 
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-        uint8_t sel[4] = { selection, 0, 0, 0 };
-        vdagent_virtio_port_write_append(virtio_port, sel, 4);
+    if (client_features.clipboard_selection) {
+        header[0] = selection;
+        header[1] = header[2] = header[3] = 0;
     }
     if (data_type != -1) {
         data_type = GUINT32_TO_LE(data_type);
-        vdagent_virtio_port_write_append(virtio_port, (uint8_t*)&data_type, 4);
+        memcpy(header + header_size, &data_type, sizeof(data_type));
+        header_size += sizeof(data_type);
     }
-
     if (msg_type == VD_AGENT_CLIPBOARD_GRAB) {
-        if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                    VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)) {
+        if (client_features.clipboard_grab_serial) {
             uint32_t serial = GUINT32_TO_LE(clipboard_serial[selection]);
             clipboard_serial[selection]++;
-            vdagent_virtio_port_write_append(virtio_port, (uint8_t*)&serial, sizeof(serial));
+            memcpy(header + header_size, &serial, sizeof(serial));
+            header_size += sizeof(serial);
         }
         virtio_msg_uint32_to_le(data, data_size, 0);
     }
+
+    vdagent_virtio_port_write_start(virtio_port, VDP_CLIENT_PORT, msg_type,
+                                    0, header_size + data_size);
+    vdagent_virtio_port_write_append(virtio_port, header, header_size);
     vdagent_virtio_port_write_append(virtio_port, data, data_size);
 }
 
 /* vdagentd <-> vdagent communication handling */
+static void agent_destroy(UdscsConnection *conn);
+
 static void do_agent_clipboard(UdscsConnection *conn,
         struct udscs_message_header *header, uint8_t *data)
 {
     uint8_t selection = header->arg1;
     uint32_t msg_type = 0, data_type = -1, size = header->size;
 
-    if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                 VD_AGENT_CAP_CLIPBOARD_BY_DEMAND))
+    if (!client_features.clipboard_by_demand)
         goto error;
 
     /* Check that this agent is from the currently active session */
@@ -752,8 +1472,7 @@ static void do_agent_clipboard(UdscsConnection *conn,
         goto error;
     }
 
-    if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                 VD_AGENT_CAP_CLIPBOARD_SELECTION) &&
+    if (!client_features.clipboard_selection &&
             selection != VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD) {
         goto error;
     }
@@ -791,7 +1510,7 @@ static void do_agent_clipboard(UdscsConnection *conn,
     if (size != header->size) {
         syslog(LOG_ERR,
                "unexpected extra data in clipboard msg, disconnecting agent");
-        udscs_server_destroy_connection(server, conn);
+        agent_destroy(conn);
         return;
     }
 
@@ -821,42 +1540,60 @@ static void check_xorg_resolution(void)
         agent_data = g_object_get_data(G_OBJECT(active_session_conn), "agent_data");
 
     if (agent_data && agent_data->screen_info) {
-        if (!uinput)
-            uinput = vdagentd_uinput_create(uinput_device,
-                                            agent_data->width,
-                                            agent_data->height,
-                                            agent_data->screen_info,
-                                            agent_data->screen_count,
-                                            debug > 1,
-                                            uinput_fake);
-        else
-            vdagentd_uinput_update_size(&uinput,
-                                        agent_data->width,
-                                        agent_data->height,
-                                        agent_data->screen_info,
-                                        agent_data->screen_count);
-        if (!uinput) {
-            syslog(LOG_CRIT, "Fatal uinput error");
-            vdagentd_quit(1);
-            return;
+        struct vdagentd_uinput *new_uinput, *old_uinput;
+        bool resized;
+
+        g_mutex_lock(&uinput_lock);
+        resized = uinput && vdagentd_uinput_update_size(uinput,
+                                                        agent_data->width,
+                                                        agent_data->height,
+                                                        agent_data->screen_info,
+                                                        agent_data->screen_count);
+        g_mutex_unlock(&uinput_lock);
+
+        /* a new tablet is set up without blocking the input thread,
+         * and only swapped in with the lock held */
+        if (!resized) {
+            new_uinput = vdagentd_uinput_create(uinput_device,
+                                                agent_data->width,
+                                                agent_data->height,
+                                                agent_data->screen_info,
+                                                agent_data->screen_count,
+                                                debug > 1,
+                                                uinput_fake,
+                                                uinput_fixed_range);
+            if (!new_uinput) {
+                syslog(LOG_CRIT, "Fatal uinput error");
+                vdagentd_quit(1);
+                return;
+            }
+            g_mutex_lock(&uinput_lock);
+            old_uinput = uinput;
+            uinput = new_uinput;
+            g_mutex_unlock(&uinput_lock);
+            vdagentd_uinput_destroy(&old_uinput);
         }
 
         if (!virtio_port) {
             syslog(LOG_INFO, "opening vdagent virtio channel");
-            virtio_port = vdagent_virtio_port_create(portdev,
-                                                     virtio_port_read_complete,
-                                                     virtio_port_error_cb);
+            virtio_port = virtio_port_create();
             if (!virtio_port) {
                 syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
                 vdagentd_quit(1);
                 return;
             }
+            update_virtio_port_reading();
             send_capabilities(virtio_port, 1);
         }
     } else {
-#ifndef WITH_STATIC_UINPUT
-        vdagentd_uinput_destroy(&uinput);
-#endif
+        if (!uinput_fixed_range) {
+            struct vdagentd_uinput *old_uinput;
+
+            g_mutex_lock(&uinput_lock);
+            old_uinput = g_steal_pointer(&uinput);
+            g_mutex_unlock(&uinput_lock);
+            vdagentd_uinput_destroy(&old_uinput);
+        }
         if (virtio_port) {
             if (only_once) {
                 syslog(LOG_INFO, "Exiting after one client session.");
@@ -864,28 +1601,12 @@ static void check_xorg_resolution(void)
                 return;
             }
             vdagent_connection_flush(VDAGENT_CONNECTION(virtio_port));
-            g_clear_pointer(&virtio_port, vdagent_connection_destroy);
+            virtio_port_close();
             syslog(LOG_INFO, "closed vdagent virtio channel");
         }
     }
 }
 
-static int connection_matches_active_session(UdscsConnection *conn,
-    void *priv)
-{
-    UdscsConnection **conn_ret = (UdscsConnection **)priv;
-    const struct agent_data *agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
-
-    /* Check if this connection matches the currently active session */
-    if (!agent_data->session || !active_session)
-        return 0;
-    if (strcmp(agent_data->session, active_session))
-        return 0;
-
-    *conn_ret = conn;
-    return 1;
-}
-
 static void release_clipboards(void)
 {
     uint8_t sel;
@@ -905,9 +1626,9 @@ static void update_active_session_connection(UdscsConnection *new_conn)
         new_conn = NULL;
         if (!active_session)
             active_session = session_info_get_active_session(session_info);
-        session_count = udscs_server_for_all_clients(server,
-                                         connection_matches_active_session,
-                                         (void*)&new_conn);
+        if (active_session)
+            new_conn = g_hash_table_lookup(session_agents, active_session);
+        session_count = new_conn ? 1 : 0;
     } else {
         if (new_conn)
             session_count++;
@@ -950,7 +1671,9 @@ static void update_active_session_connection(UdscsConnection *new_conn)
 
 static gboolean remove_active_xfers(gpointer key, gpointer value, gpointer conn)
 {
-    if (value == conn) {
+    FileXfer *xfer = value;
+
+    if (xfer->conn == conn) {
         send_file_xfer_status(virtio_port,
                               "Agent disc; cancelling file-xfer %u",
                               GPOINTER_TO_UINT(key),
@@ -960,20 +1683,6 @@ static gboolean remove_active_xfers(gpointer key, gpointer value, gpointer conn)
         return 0;
 }
 
-/* Check if this connection matches the passed session */
-static int connection_matches_session(UdscsConnection *conn, void *priv)
-{
-    const char *session = priv;
-    const struct agent_data *agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
-
-    if (!agent_data || !agent_data->session ||
-        strcmp(agent_data->session, session) != 0) {
-        return 0;
-    }
-
-    return 1;
-}
-
 /* Check a given process has a given UID */
 static bool check_uid_of_pid(pid_t pid, uid_t uid)
 {
@@ -1030,9 +1739,8 @@ static void agent_connect(UdscsConnection *conn)
         }
 
         // Check there are no other connection for this session
-        // Note that "conn" is not counted as "agent_data" is still not attached to it
-        if (udscs_server_for_all_clients(server, connection_matches_session,
-                                         agent_data->session) > 0) {
+        if (agent_data->session &&
+            g_hash_table_contains(session_agents, agent_data->session)) {
             syslog(LOG_ERR, "An agent is already connected for this session");
             agent_data_destroy(agent_data);
             udscs_server_destroy_connection(server, conn);
@@ -1042,27 +1750,46 @@ static void agent_connect(UdscsConnection *conn)
 
     g_object_set_data_full(G_OBJECT(conn), "agent_data", agent_data,
                            (GDestroyNotify) agent_data_destroy);
+    if (agent_data->session) {
+        g_hash_table_insert(session_agents, agent_data->session, conn);
+    }
+    vdagent_connection_set_watermarks(VDAGENT_CONNECTION(conn),
+                                      AGENT_QUEUE_LOW_MARK,
+                                      AGENT_QUEUE_HIGH_MARK,
+                                      agent_watermark_cb);
     udscs_write(conn, VDAGENTD_VERSION, 0, 0,
                 (uint8_t *)VERSION, strlen(VERSION) + 1);
     update_active_session_connection(conn);
 
     if (device_info) {
-        forward_data_to_session_agent(VDAGENTD_GRAPHICS_DEVICE_INFO,
-                                      (uint8_t *) device_info, device_info_size);
+        forward_data_to_session_agent(VDAGENTD_GRAPHICS_DEVICE_INFO, device_info);
     }
 }
 
-static void agent_disconnect(VDAgentConnection *conn, GError *err)
+/* Remove an agent connection which passed agent_connect() */
+static void agent_destroy(UdscsConnection *conn)
 {
+    const struct agent_data *agent_data =
+        g_object_get_data(G_OBJECT(conn), "agent_data");
+
     g_hash_table_foreach_remove(active_xfers, remove_active_xfers, conn);
 
+    if (agent_data->session &&
+        g_hash_table_lookup(session_agents, agent_data->session) == conn) {
+        g_hash_table_remove(session_agents, agent_data->session);
+    }
+    udscs_server_destroy_connection(server, conn);
+
+    update_active_session_connection(NULL);
+}
+
+static void agent_disconnect(VDAgentConnection *conn, GError *err)
+{
     if (err) {
         syslog(LOG_ERR, "%s", err->message);
         g_error_free(err);
     }
-    udscs_server_destroy_connection(server, UDSCS_CONNECTION(conn));
-
-    update_active_session_connection(NULL);
+    agent_destroy(UDSCS_CONNECTION(conn));
 }
 
 static void do_agent_xorg_resolution(UdscsConnection             *conn,
@@ -1085,7 +1812,7 @@ static void do_agent_xorg_resolution(UdscsConnection             *conn,
     if (header->size != n * res_size) {
         syslog(LOG_ERR, "guest xorg resolution message has wrong size, "
                         "disconnecting agent");
-        udscs_server_destroy_connection(server, conn);
+        agent_destroy(conn);
         return;
     }
 
@@ -1106,8 +1833,8 @@ static void do_agent_file_xfer_status(UdscsConnection             *conn,
     const gchar *log_msg = NULL;
     guint data_size = 0;
 
-    UdscsConnection *task_conn = g_hash_table_lookup(active_xfers, task_id);
-    if (task_conn == NULL || task_conn != conn) {
+    FileXfer *xfer = g_hash_table_lookup(active_xfers, task_id);
+    if (xfer == NULL || xfer->conn != conn) {
         // Protect against misbehaving agent.
         // Ignore the message, but do not disconnect the agent, to protect against
         // a misbehaving client that tries to disconnect a good agent
@@ -1157,13 +1884,150 @@ static void agent_read_complete(UdscsConnection *conn,
     }
 }
 
-static gboolean si_io_channel_cb(GIOChannel  *source,
-                                 GIOCondition condition,
-                                 gpointer     data)
+static void session_info_changed(gpointer user_data)
 {
     active_session = session_info_get_active_session(session_info);
     update_active_session_connection(NULL);
-    return G_SOURCE_CONTINUE;
+}
+
+/* statistics */
+
+static const char * const vdagent_message_names[VD_AGENT_END_MESSAGE] = {
+    [VD_AGENT_MOUSE_STATE] = "mouse state",
+    [VD_AGENT_MONITORS_CONFIG] = "monitors config",
+    [VD_AGENT_REPLY] = "reply",
+    [VD_AGENT_CLIPBOARD] = "clipboard",
+    [VD_AGENT_DISPLAY_CONFIG] = "display config",
+    [VD_AGENT_ANNOUNCE_CAPABILITIES] = "announce capabilities",
+    [VD_AGENT_CLIPBOARD_GRAB] = "clipboard grab",
+    [VD_AGENT_CLIPBOARD_REQUEST] = "clipboard request",
+    [VD_AGENT_CLIPBOARD_RELEASE] = "clipboard release",
+    [VD_AGENT_FILE_XFER_START] = "file xfer start",
+    [VD_AGENT_FILE_XFER_STATUS] = "file xfer status",
+    [VD_AGENT_FILE_XFER_DATA] = "file xfer data",
+    [VD_AGENT_CLIENT_DISCONNECTED] = "client disconnected",
+    [VD_AGENT_MAX_CLIPBOARD] = "max clipboard",
+    [VD_AGENT_AUDIO_VOLUME_SYNC] = "audio volume sync",
+    [VD_AGENT_GRAPHICS_DEVICE_INFO] = "graphics device info",
+};
+
+/* Only the message types which were seen are listed */
+static void write_message_stats(StatsWriter *w,
+                                const char * const *names, guint n_types,
+                                const VDAgentMessageStats *received,
+                                const VDAgentMessageStats *sent)
+{
+    guint type;
+
+    stats_writer_begin_list(w, "messages");
+    for (type = 0; type < n_types; type++) {
+        if (received[type].messages == 0 && sent[type].messages == 0) {
+            continue;
+        }
+        stats_writer_begin_group(w, NULL);
+        stats_writer_add_string(w, "type",
+                                names[type] ? names[type] : "unknown");
+        stats_writer_add_uint(w, "received", received[type].messages);
+        stats_writer_add_uint(w, "received_bytes", received[type].bytes);
+        stats_writer_add_uint(w, "sent", sent[type].messages);
+        stats_writer_add_uint(w, "sent_bytes", sent[type].bytes);
+        stats_writer_end_group(w);
+    }
+    stats_writer_end_list(w);
+}
+
+static void write_connection_stats(StatsWriter *w, VDAgentConnection *conn)
+{
+    BufferPoolStats pool_stats;
+
+    stats_writer_add_uint(w, "write_queue_bytes",
+                          vdagent_connection_get_queued_bytes(conn));
+
+    buffer_pool_get_stats(vdagent_connection_get_buffer_pool(conn),
+                          &pool_stats);
+    stats_writer_begin_group(w, "buffer_pool");
+    stats_writer_add_uint(w, "hits", pool_stats.hits);
+    stats_writer_add_uint(w, "misses", pool_stats.misses);
+    stats_writer_add_uint(w, "large", pool_stats.large);
+    stats_writer_end_group(w);
+}
+
+static int write_agent_stats(UdscsConnection *conn, void *priv)
+{
+    StatsWriter *w = priv;
+    const struct agent_data *agent_data =
+        g_object_get_data(G_OBJECT(conn), "agent_data");
+
+    stats_writer_begin_group(w, NULL);
+    stats_writer_add_string(w, "session",
+                            agent_data ? agent_data->session : NULL);
+    stats_writer_add_bool(w, "active", conn == active_session_conn);
+    write_connection_stats(w, VDAGENT_CONNECTION(conn));
+    stats_writer_end_group(w);
+    return 1;
+}
+
+static void write_stats(StatsWriter *w)
+{
+    GHashTableIter iter;
+    FileXfer *xfer;
+    GList *l;
+    gsize pending;
+    VDAgentMessageStats received[VD_AGENT_END_MESSAGE];
+    VDAgentMessageStats sent[VD_AGENT_END_MESSAGE];
+
+    stats_writer_begin_group(w, "client");
+    stats_writer_add_bool(w, "connected", client_connected);
+    stats_writer_add_uint(w, "virtio_reconnects", virtio_reconnects);
+    if (virtio_port) {
+        write_connection_stats(w, VDAGENT_CONNECTION(virtio_port));
+    }
+    vdagent_virtio_port_get_message_stats(FALSE, received);
+    vdagent_virtio_port_get_message_stats(TRUE, sent);
+    write_message_stats(w, vdagent_message_names, VD_AGENT_END_MESSAGE,
+                        received, sent);
+    stats_writer_end_group(w);
+
+    stats_writer_begin_group(w, "agents");
+    stats_writer_add_uint(w, "congested", congested_agents);
+    stats_writer_begin_list(w, "connections");
+    udscs_server_for_all_clients(server, write_agent_stats, w);
+    stats_writer_end_list(w);
+    write_message_stats(w, vdagentd_messages, VDAGENTD_NO_MESSAGES,
+                        udscs_get_message_stats(FALSE),
+                        udscs_get_message_stats(TRUE));
+    stats_writer_end_group(w);
+
+    stats_writer_begin_group(w, "file_xfers");
+    stats_writer_add_uint(w, "active", g_hash_table_size(active_xfers));
+    stats_writer_add_uint(w, "pending_bytes", xfers_pending_bytes);
+    stats_writer_add_bool(w, "congested", xfers_congested);
+    stats_writer_begin_list(w, "transfers");
+    g_hash_table_iter_init(&iter, active_xfers);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&xfer)) {
+        pending = 0;
+        for (l = xfer->pending.head; l; l = l->next) {
+            pending += g_bytes_get_size(l->data);
+        }
+        stats_writer_begin_group(w, NULL);
+        stats_writer_add_uint(w, "id", xfer->id);
+        stats_writer_add_uint(w, "received_bytes", xfer->bytes_received);
+        stats_writer_add_uint(w, "forwarded_bytes", xfer->bytes_forwarded);
+        stats_writer_add_uint(w, "pending_bytes", pending);
+        stats_writer_add_uint(w, "in_flight_bytes", xfer->in_flight);
+        stats_writer_end_group(w);
+    }
+    stats_writer_end_list(w);
+    stats_writer_end_group(w);
+
+    stats_writer_begin_group(w, "mouse");
+    stats_writer_add_uint(w, "states_received",
+                          __atomic_load_n(&mouse_states_received, __ATOMIC_RELAXED));
+    stats_writer_add_uint(w, "states_coalesced",
+                          __atomic_load_n(&mouse_states_coalesced, __ATOMIC_RELAXED));
+    stats_writer_add_uint(w, "uinput_events",
+                          vdagentd_uinput_get_events_emitted());
+    stats_writer_end_group(w);
 }
 
 /* main */
@@ -1222,6 +2086,24 @@ static gboolean parse_debug_level_cb(const gchar *option_name,
     return TRUE;
 }
 
+static gboolean parse_stats_cb(const gchar *option_name,
+                               const gchar *value,
+                               gpointer     data,
+                               GError     **error)
+{
+    stats_query = TRUE;
+    if (value == NULL || g_strcmp0(value, "text") == 0) {
+        stats_json = FALSE;
+    } else if (g_strcmp0(value, "json") == 0) {
+        stats_json = TRUE;
+    } else {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "unknown stats format: %s", value);
+        return FALSE;
+    }
+    return TRUE;
+}
+
 static GOptionEntry cmd_entries[] = {
     { "debug", 'd', G_OPTION_FLAG_NO_ARG,
       G_OPTION_ARG_CALLBACK, parse_debug_level_cb,
@@ -1243,6 +2125,14 @@ static GOptionEntry cmd_entries[] = {
       G_OPTION_ARG_NONE, &uinput_fake,
       "Treat uinput device as fake; no ioctls", NULL },
 
+    { "uinput-fixed-range", 0, 0,
+      G_OPTION_ARG_NONE, &uinput_fixed_range,
+      "Keep one uinput device with a fixed range across resolution changes", NULL },
+
+    { "no-uinput-fixed-range", 0, G_OPTION_FLAG_REVERSE,
+      G_OPTION_ARG_NONE, &uinput_fixed_range,
+      "Recreate the uinput device with the new range on resolution changes", NULL },
+
     { "foreground", 'x', G_OPTION_FLAG_REVERSE,
       G_OPTION_ARG_NONE, &do_daemonize,
       "Do not daemonize the agent", NULL},
@@ -1257,6 +2147,14 @@ static GOptionEntry cmd_entries[] = {
       "Disable console kit and systemd-logind integration", NULL },
 #endif
 
+    { "no-mouse-coalescing", 0, G_OPTION_FLAG_REVERSE,
+      G_OPTION_ARG_NONE, &mouse_coalescing,
+      "Pass every mouse state received from the client to uinput", NULL },
+
+    { "stats", 0, G_OPTION_FLAG_OPTIONAL_ARG,
+      G_OPTION_ARG_CALLBACK, parse_stats_cb,
+      "Print the statistics of the running daemon and exit", "text|json" },
+
     { NULL }
 };
 
@@ -1265,8 +2163,7 @@ int main(int argc, char *argv[])
     GOptionContext *context;
     GError *err = NULL;
     gboolean own_socket = TRUE;
-    GIOChannel *si_io_channel = NULL;
-    guint si_watch_id = 0;
+    gchar *stats_socket;
 
     context = g_option_context_new(NULL);
     g_option_context_add_main_entries(context, cmd_entries, NULL);
@@ -1290,6 +2187,16 @@ int main(int argc, char *argv[])
     if (uinput_device == NULL) {
         uinput_device = g_strdup(DEFAULT_UINPUT_DEVICE);
     }
+    stats_socket = g_strconcat(vdagentd_socket, STATS_SOCKET_SUFFIX, NULL);
+
+    if (stats_query) {
+        retval = stats_client_run(stats_socket, stats_json);
+        g_free(portdev);
+        g_free(vdagentd_socket);
+        g_free(uinput_device);
+        g_free(stats_socket);
+        return retval;
+    }
 
     openlog("spice-vdagentd", do_daemonize ? 0 : LOG_PERROR, LOG_USER);
 
@@ -1323,18 +2230,19 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-#ifdef WITH_STATIC_UINPUT
-    uinput = vdagentd_uinput_create(uinput_device, 1024, 768, NULL, 0,
-                                    debug > 1, uinput_fake);
-    if (!uinput) {
-        udscs_destroy_server(server);
-        return 1;
-    }
-#endif
-
     if (do_daemonize)
         daemonize();
 
+    /* only once daemonized, opening a fake uinput FIFO blocks until
+     * a reader opens it */
+    if (uinput_fixed_range) {
+        uinput = vdagentd_uinput_create(uinput_device, 1024, 768, NULL, 0,
+                                        debug > 1, uinput_fake, TRUE);
+        if (!uinput) {
+            retval = 1;
+        }
+    }
+
     g_unix_signal_add(SIGINT, signal_handler, NULL);
     g_unix_signal_add(SIGHUP, signal_handler, NULL);
     g_unix_signal_add(SIGTERM, signal_handler, NULL);
@@ -1342,30 +2250,41 @@ int main(int argc, char *argv[])
     if (want_session_info)
         session_info = session_info_create(debug);
     if (session_info) {
-        si_io_channel = g_io_channel_unix_new(session_info_get_fd(session_info));
-        si_watch_id = g_io_add_watch(si_io_channel, G_IO_IN, si_io_channel_cb, NULL);
-        g_io_channel_unref(si_io_channel);
+        session_info_set_changed_callback(session_info, session_info_changed,
+                                          NULL);
     } else {
         syslog(LOG_WARNING, "no session info, max 1 session agent allowed");
     }
 
-    active_xfers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    session_agents = g_hash_table_new(g_str_hash, g_str_equal);
+    active_xfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                         NULL, file_xfer_remove);
+    update_client_features(NULL, 0);
+
+    stats_server = stats_server_new(stats_socket, write_stats, &err);
+    if (err) {
+        syslog(LOG_WARNING, "Could not create the stats socket %s: %s",
+               stats_socket, err->message);
+        g_clear_error(&err);
+    }
 
-    udscs_server_start(server);
     loop = g_main_loop_new(NULL, FALSE);
-    g_main_loop_run(loop);
+    if (retval == 0) {
+        udscs_server_start(server);
+        g_main_loop_run(loop);
+    }
 
     release_clipboards();
 
+    g_mutex_lock(&uinput_lock);
     vdagentd_uinput_destroy(&uinput);
-    if (si_watch_id > 0) {
-        g_source_remove(si_watch_id);
-    }
+    g_mutex_unlock(&uinput_lock);
     g_clear_pointer(&session_info, session_info_destroy);
+    g_clear_pointer(&stats_server, stats_server_destroy);
     g_clear_pointer(&server, udscs_destroy_server);
     if (virtio_port) {
         vdagent_connection_flush(VDAGENT_CONNECTION(virtio_port));
-        g_clear_pointer(&virtio_port, vdagent_connection_destroy);
+        virtio_port_close();
     }
 
     /* allow the VDAgentConnection(s) to finalize properly */
@@ -1386,6 +2305,7 @@ int main(int argc, char *argv[])
     g_free(portdev);
     g_free(vdagentd_socket);
     g_free(uinput_device);
+    g_free(stats_socket);
 
     return retval;
 }
@@ -27,13 +27,25 @@
 #include <glib-unix.h>
 
 #include "vdagent-connection.h"
+#include "vdagent-probes.h"
 #include "virtio-port.h"
 
 
+/* Number of chunks queued at once, so that a segment fits
+ * into a pooled buffer */
+#define WRITE_SEGMENT_CHUNKS \
+    (BUFFER_POOL_MAX_SIZE / (sizeof(VDIChunkHeader) + VD_AGENT_MAX_DATA_SIZE))
+
+/* The message being written is split into chunks as data is appended,
+   the chunks are queued in segments of up to WRITE_SEGMENT_CHUNKS */
 struct vdagent_virtio_port_buf {
-    uint8_t *buf;
+    uint8_t *buf;         /* segment being filled */
     size_t size;
     size_t write_pos;
+    size_t chunk_left;    /* bytes left in the current chunk */
+    uint32_t message_left; /* bytes of the message not appended yet */
+    uint32_t port_nr;
+    VDAgentConnectionPriority priority;
 };
 
 /* Data to keep track of the assembling of vdagent messages per chunk port,
@@ -43,6 +55,7 @@ struct vdagent_virtio_port_chunk_port_data {
     int message_data_pos;
     VDAgentMessage message_header;
     uint8_t *message_data;
+    gboolean streaming;
 };
 
 struct _VirtioPort {
@@ -55,11 +68,49 @@ struct _VirtioPort {
 
     /* Callbacks */
     vdagent_virtio_port_read_callback read_callback;
+    vdagent_virtio_port_begin_callback begin_callback;
+    vdagent_virtio_port_data_callback data_callback;
+    vdagent_virtio_port_end_callback end_callback;
+    vdagent_virtio_port_messages_done_callback messages_done_callback;
     VDAgentConnErrorCb error_cb;
+
+    /* Message being passed to the read_callback */
+    gboolean reading;
+    uint32_t read_size;
+    struct vdagent_virtio_port_chunk_port_data *read_port; /* if reassembled */
+    GBytes *read_bytes;
 };
 
 G_DEFINE_TYPE(VirtioPort, virtio_port, VDAGENT_TYPE_CONNECTION)
 
+/* Messages received and sent by all ports, per type, updated atomically
+ * as messages are received on the input thread */
+static VDAgentMessageStats messages_received[VD_AGENT_END_MESSAGE];
+static VDAgentMessageStats messages_sent[VD_AGENT_END_MESSAGE];
+
+static void count_message(VDAgentMessageStats *stats,
+                          uint32_t type, uint32_t size)
+{
+    if (type < VD_AGENT_END_MESSAGE) {
+        __atomic_fetch_add(&stats[type].messages, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats[type].bytes, size, __ATOMIC_RELAXED);
+    }
+}
+
+void vdagent_virtio_port_get_message_stats(gboolean sent,
+                                           VDAgentMessageStats *stats)
+{
+    const VDAgentMessageStats *counters = sent ? messages_sent : messages_received;
+    guint type;
+
+    for (type = 0; type < VD_AGENT_END_MESSAGE; type++) {
+        stats[type].messages = __atomic_load_n(&counters[type].messages,
+                                               __ATOMIC_RELAXED);
+        stats[type].bytes = __atomic_load_n(&counters[type].bytes,
+                                            __ATOMIC_RELAXED);
+    }
+}
+
 static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
                                          gpointer header_data,
                                          gpointer chunk_data);
@@ -90,19 +141,51 @@ static gsize conn_handle_header(VDAgentConnection *conn,
     return header->size;
 }
 
+static void conn_handle_messages_done(VDAgentConnection *conn)
+{
+    VirtioPort *self = VIRTIO_PORT(conn);
+
+    if (self->messages_done_callback) {
+        self->messages_done_callback(self);
+    }
+}
+
 static void virtio_port_init(VirtioPort *self)
 {
 }
 
+static void end_stream(VirtioPort *vport, int port_nr)
+{
+    struct vdagent_virtio_port_chunk_port_data *port = &vport->port_data[port_nr];
+
+    if (port->streaming) {
+        port->streaming = FALSE;
+        vport->end_callback(vport, port_nr,
+                            port->message_data_pos == port->message_header.size);
+    }
+}
+
+static void virtio_port_dispose(GObject *obj)
+{
+    VirtioPort *self = VIRTIO_PORT(obj);
+    guint i;
+
+    for (i = 0; i < VDP_END_PORT; i++) {
+        end_stream(self, i);
+    }
+
+    G_OBJECT_CLASS(virtio_port_parent_class)->dispose(obj);
+}
+
 static void virtio_port_finalize(GObject *obj)
 {
     VirtioPort *self = VIRTIO_PORT(obj);
     guint i;
 
-    g_free(self->write_buf.buf);
+    buffer_pool_release(self->write_buf.buf);
 
     for (i = 0; i < VDP_END_PORT; i++) {
-        g_free(self->port_data[i].message_data);
+        buffer_pool_release(self->port_data[i].message_data);
     }
 
     G_OBJECT_CLASS(virtio_port_parent_class)->finalize(obj);
@@ -113,13 +196,16 @@ static void virtio_port_class_init(VirtioPortClass *klass)
     GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
     VDAgentConnectionClass *conn_class = VDAGENT_CONNECTION_CLASS(klass);
 
+    gobject_class->dispose   = virtio_port_dispose;
     gobject_class->finalize  = virtio_port_finalize;
 
     conn_class->handle_header = conn_handle_header;
     conn_class->handle_message = vdagent_virtio_port_do_chunk;
+    conn_class->handle_messages_done = conn_handle_messages_done;
 }
 
 VirtioPort *vdagent_virtio_port_create(const char *portname,
+    GMainContext *read_context,
     vdagent_virtio_port_read_callback read_callback,
     VDAgentConnErrorCb error_cb)
 {
@@ -140,6 +226,7 @@ VirtioPort *vdagent_virtio_port_create(const char *portname,
     }
 
     vport = g_object_new(VIRTIO_TYPE_PORT, NULL);
+    vdagent_connection_set_read_context(VDAGENT_CONNECTION(vport), read_context);
 
     /* When calling vdagent_connection_new(),
      * @wait_on_opening MUST be set to TRUE:
@@ -173,6 +260,105 @@ VirtioPort *vdagent_virtio_port_create(const char *portname,
     return vport;
 }
 
+void vdagent_virtio_port_set_stream_callbacks(VirtioPort *vport,
+    vdagent_virtio_port_begin_callback begin_callback,
+    vdagent_virtio_port_data_callback data_callback,
+    vdagent_virtio_port_end_callback end_callback)
+{
+    vport->begin_callback = begin_callback;
+    vport->data_callback = data_callback;
+    vport->end_callback = end_callback;
+}
+
+void vdagent_virtio_port_set_messages_done_callback(VirtioPort *vport,
+    vdagent_virtio_port_messages_done_callback messages_done_callback)
+{
+    vport->messages_done_callback = messages_done_callback;
+}
+
+/* Clipboard and file transfer data are queued with a lower priority,
+ * so that they don't delay replies and status messages. Clipboard control
+ * messages share the class of clipboard data, as they must not overtake it.
+ * The chunks of a message are queued as a single connection message,
+ * so chunks of different messages never interleave. */
+static VDAgentConnectionPriority message_priority(uint32_t message_type)
+{
+    switch (message_type) {
+    case VD_AGENT_CLIPBOARD:
+    case VD_AGENT_CLIPBOARD_GRAB:
+    case VD_AGENT_CLIPBOARD_REQUEST:
+    case VD_AGENT_CLIPBOARD_RELEASE:
+    case VD_AGENT_FILE_XFER_DATA:
+        return VDAGENT_CONNECTION_PRIORITY_BULK;
+    default:
+        return VDAGENT_CONNECTION_PRIORITY_CONTROL;
+    }
+}
+
+/* Queues the filled segment, the message is complete once all of it
+ * was appended */
+static void write_segment(VirtioPort *vport)
+{
+    struct vdagent_virtio_port_buf *wbuf = &vport->write_buf;
+    GBytes *bytes;
+
+    bytes = buffer_pool_bytes_new_take(wbuf->buf, wbuf->size);
+    vdagent_connection_write_message_part(VDAGENT_CONNECTION(vport),
+                                          wbuf->priority, bytes,
+                                          wbuf->message_left == 0);
+    g_bytes_unref(bytes);
+    wbuf->buf = NULL;
+}
+
+static void start_chunk(VirtioPort *vport)
+{
+    struct vdagent_virtio_port_buf *wbuf = &vport->write_buf;
+    VDIChunkHeader *chunk_header;
+    uint32_t n_chunks;
+
+    if (wbuf->buf == NULL) {
+        n_chunks = (wbuf->message_left + VD_AGENT_MAX_DATA_SIZE - 1) /
+                   VD_AGENT_MAX_DATA_SIZE;
+        n_chunks = MIN(n_chunks, WRITE_SEGMENT_CHUNKS);
+        wbuf->size = n_chunks * sizeof(*chunk_header) +
+                     MIN(wbuf->message_left, n_chunks * VD_AGENT_MAX_DATA_SIZE);
+        wbuf->write_pos = 0;
+        wbuf->buf = buffer_pool_alloc(
+            vdagent_connection_get_buffer_pool(VDAGENT_CONNECTION(vport)),
+            wbuf->size);
+    }
+
+    wbuf->chunk_left = MIN(wbuf->message_left, VD_AGENT_MAX_DATA_SIZE);
+    chunk_header = (VDIChunkHeader *) (wbuf->buf + wbuf->write_pos);
+    chunk_header->port = GUINT32_TO_LE(wbuf->port_nr);
+    chunk_header->size = GUINT32_TO_LE(wbuf->chunk_left);
+    wbuf->write_pos += sizeof(*chunk_header);
+}
+
+static void write_data(VirtioPort *vport, const uint8_t *data, uint32_t size)
+{
+    struct vdagent_virtio_port_buf *wbuf = &vport->write_buf;
+    uint32_t n;
+
+    while (size > 0) {
+        if (wbuf->chunk_left == 0) {
+            start_chunk(vport);
+        }
+
+        n = MIN(size, wbuf->chunk_left);
+        memcpy(wbuf->buf + wbuf->write_pos, data, n);
+        wbuf->write_pos += n;
+        wbuf->chunk_left -= n;
+        wbuf->message_left -= n;
+        data += n;
+        size -= n;
+
+        if (wbuf->write_pos == wbuf->size) {
+            write_segment(vport);
+        }
+    }
+}
+
 void vdagent_virtio_port_write_start(
         VirtioPort *vport,
         uint32_t port_nr,
@@ -180,28 +366,22 @@ void vdagent_virtio_port_write_start(
         uint32_t message_opaque,
         uint32_t data_size)
 {
-    struct vdagent_virtio_port_buf *new_wbuf;
-    VDIChunkHeader *chunk_header;
-    VDAgentMessage *message_header;
-
-    g_return_if_fail(vport->write_buf.buf == NULL);
-
-    new_wbuf = &vport->write_buf;
-    new_wbuf->write_pos = 0;
-    new_wbuf->size = sizeof(*chunk_header) + sizeof(*message_header) + data_size;
-    new_wbuf->buf = g_malloc(new_wbuf->size);
-
-    chunk_header = (VDIChunkHeader *) (new_wbuf->buf + new_wbuf->write_pos);
-    chunk_header->port = GUINT32_TO_LE(port_nr);
-    chunk_header->size = GUINT32_TO_LE(sizeof(*message_header) + data_size);
-    new_wbuf->write_pos += sizeof(*chunk_header);
-
-    message_header = (VDAgentMessage *) (new_wbuf->buf + new_wbuf->write_pos);
-    message_header->protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL);
-    message_header->type = GUINT32_TO_LE(message_type);
-    message_header->opaque = GUINT64_TO_LE(message_opaque);
-    message_header->size = GUINT32_TO_LE(data_size);
-    new_wbuf->write_pos += sizeof(*message_header);
+    struct vdagent_virtio_port_buf *wbuf = &vport->write_buf;
+    VDAgentMessage message_header;
+
+    g_return_if_fail(wbuf->message_left == 0);
+
+    VDAGENT_PROBE(virtio_message_send, port_nr, message_type, data_size);
+    count_message(messages_sent, message_type, data_size);
+    wbuf->port_nr = port_nr;
+    wbuf->priority = message_priority(message_type);
+    wbuf->message_left = sizeof(message_header) + data_size;
+
+    message_header.protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL);
+    message_header.type = GUINT32_TO_LE(message_type);
+    message_header.opaque = GUINT64_TO_LE(message_opaque);
+    message_header.size = GUINT32_TO_LE(data_size);
+    write_data(vport, (const uint8_t *) &message_header, sizeof(message_header));
 }
 
 int vdagent_virtio_port_write_append(VirtioPort *vport,
@@ -214,23 +394,17 @@ int vdagent_virtio_port_write_append(VirtioPort *vport,
     }
 
     wbuf = &vport->write_buf;
-    if (!wbuf->buf) {
-        syslog(LOG_ERR, "can't append without a buffer");
+    if (wbuf->message_left == 0) {
+        syslog(LOG_ERR, "can't append without a message");
         return -1;
     }
 
-    if (wbuf->size - wbuf->write_pos < size) {
-        syslog(LOG_ERR, "can't append to full buffer");
+    if (wbuf->message_left < size) {
+        syslog(LOG_ERR, "can't append past the end of the message");
         return -1;
     }
 
-    memcpy(wbuf->buf + wbuf->write_pos, data, size);
-    wbuf->write_pos += size;
-
-    if (wbuf->write_pos == wbuf->size) {
-        vdagent_connection_write(VDAGENT_CONNECTION(vport), wbuf->buf, wbuf->size);
-        wbuf->buf = NULL;
-    }
+    write_data(vport, data, size);
     return 0;
 }
 
@@ -253,10 +427,87 @@ void vdagent_virtio_port_reset(VirtioPort *vport, int port)
         syslog(LOG_ERR, "vdagent_virtio_port_reset port out of range");
         return;
     }
-    g_free(vport->port_data[port].message_data);
+    end_stream(vport, port);
+    buffer_pool_release(vport->port_data[port].message_data);
     memset(&vport->port_data[port], 0, sizeof(vport->port_data[0]));
 }
 
+/* @port is the port data of reassembled messages, NULL otherwise */
+static void call_read_callback(VirtioPort *vport, int port_nr,
+                               struct vdagent_virtio_port_chunk_port_data *port,
+                               VDAgentMessage *message_header, uint8_t *data)
+{
+    if (!vport->read_callback) {
+        return;
+    }
+
+    vport->reading = TRUE;
+    vport->read_size = message_header->size;
+    vport->read_port = port;
+    vport->read_callback(vport, port_nr, message_header, data);
+    vport->reading = FALSE;
+    vport->read_port = NULL;
+    g_clear_pointer(&vport->read_bytes, g_bytes_unref);
+}
+
+GBytes *vdagent_virtio_port_get_message_bytes(VirtioPort *vport)
+{
+    GBytes *chunk;
+
+    g_return_val_if_fail(vport->reading, NULL);
+
+    if (vport->read_bytes == NULL) {
+        if (vport->read_size == 0) {
+            vport->read_bytes = g_bytes_new(NULL, 0);
+        } else if (vport->read_port) {
+            /* hand over the buffer the message was reassembled in */
+            vport->read_bytes = buffer_pool_bytes_new_take(
+                vport->read_port->message_data, vport->read_size);
+            vport->read_port->message_data = NULL;
+        } else {
+            chunk = vdagent_connection_get_message_bytes(VDAGENT_CONNECTION(vport));
+            vport->read_bytes = g_bytes_new_from_bytes(chunk, sizeof(VDAgentMessage),
+                                                       vport->read_size);
+            g_bytes_unref(chunk);
+        }
+    }
+    return g_bytes_ref(vport->read_bytes);
+}
+
+/* Most messages fit into a single chunk, these are passed to the
+ * read_callback straight from the chunk, without reassembling them.
+ * Returns FALSE if the chunk doesn't hold a complete message. */
+static gboolean vdagent_virtio_port_do_single_chunk(VirtioPort *vport,
+                                                    VDIChunkHeader *chunk_header,
+                                                    uint8_t *chunk_data)
+{
+    VDAgentMessage message_header;
+    uint8_t *data = chunk_data + sizeof(message_header);
+
+    if (chunk_header->size < sizeof(message_header)) {
+        return FALSE;
+    }
+
+    memcpy(&message_header, chunk_data, sizeof(message_header));
+    message_header.size = GUINT32_FROM_LE(message_header.size);
+    /* handlers access the data as 32-bit integers */
+    if (message_header.size != chunk_header->size - sizeof(message_header) ||
+        (guintptr)data % sizeof(uint32_t) != 0) {
+        return FALSE;
+    }
+    message_header.protocol = GUINT32_FROM_LE(message_header.protocol);
+    message_header.type = GUINT32_FROM_LE(message_header.type);
+    message_header.opaque = GUINT64_FROM_LE(message_header.opaque);
+
+    VDAGENT_PROBE(virtio_message_complete, chunk_header->port,
+                  message_header.type, message_header.size,
+                  message_header.opaque);
+    count_message(messages_received, message_header.type, message_header.size);
+    call_read_callback(vport, chunk_header->port, NULL, &message_header,
+                       message_header.size ? data : NULL);
+    return TRUE;
+}
+
 static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
                                          gpointer header_data,
                                          gpointer chunk_data)
@@ -267,6 +518,13 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
     struct vdagent_virtio_port_chunk_port_data *port =
         &vport->port_data[chunk_header->port];
 
+    VDAGENT_PROBE(virtio_chunk_received, chunk_header->port, chunk_header->size);
+
+    if (port->message_header_read == 0 &&
+        vdagent_virtio_port_do_single_chunk(vport, chunk_header, chunk_data)) {
+        return;
+    }
+
     if (port->message_header_read < sizeof(port->message_header)) {
         read = sizeof(port->message_header) - port->message_header_read;
         if (read > chunk_header->size) {
@@ -282,8 +540,16 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
             port->message_header.opaque = GUINT64_FROM_LE(port->message_header.opaque);
             port->message_header.size = GUINT32_FROM_LE(port->message_header.size);
 
-            if (port->message_header.size) {
-                port->message_data = g_malloc(port->message_header.size);
+            /* messages spanning several chunks may be streamed */
+            if (port->message_header.size > chunk_header->size - read &&
+                vport->begin_callback &&
+                vport->begin_callback(vport, chunk_header->port,
+                                      &port->message_header)) {
+                port->streaming = TRUE;
+            } else if (port->message_header.size) {
+                port->message_data = buffer_pool_alloc(
+                    vdagent_connection_get_buffer_pool(conn),
+                    port->message_header.size);
             }
         }
         pos = read;
@@ -303,20 +569,36 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
         if (avail < read)
             read = avail;
 
-        if (read) {
+        if (read && port->streaming) {
+            GBytes *chunk, *fragment;
+
+            chunk = vdagent_connection_get_message_bytes(conn);
+            fragment = g_bytes_new_from_bytes(chunk, pos, read);
+            vport->data_callback(vport, chunk_header->port, fragment);
+            g_bytes_unref(fragment);
+            g_bytes_unref(chunk);
+            port->message_data_pos += read;
+        } else if (read) {
             memcpy(port->message_data + port->message_data_pos,
                    chunk_data + pos, read);
             port->message_data_pos += read;
         }
 
         if (port->message_data_pos == port->message_header.size) {
-            if (vport->read_callback) {
-                vport->read_callback(vport, chunk_header->port,
-                                     &port->message_header, port->message_data);
+            VDAGENT_PROBE(virtio_message_complete, chunk_header->port,
+                          port->message_header.type, port->message_header.size,
+                          port->message_header.opaque);
+            count_message(messages_received, port->message_header.type,
+                          port->message_header.size);
+            if (port->streaming) {
+                end_stream(vport, chunk_header->port);
+            } else {
+                call_read_callback(vport, chunk_header->port, port,
+                                   &port->message_header, port->message_data);
             }
             port->message_header_read = 0;
             port->message_data_pos = 0;
-            g_clear_pointer(&port->message_data, g_free);
+            g_clear_pointer(&port->message_data, buffer_pool_release);
         }
     }
 }
@@ -40,12 +40,65 @@ typedef void (*vdagent_virtio_port_read_callback)(
     VDAgentMessage *message_header,
     uint8_t *data);
 
-/* Create a vdagent virtio port object for port portname */
+/* Callbacks with these types are used to receive messages which span
+   several chunks incrementally, as the chunks arrive.
+
+   The begin callback is called once the message header has been read,
+   if it returns FALSE, the message is passed to the read callback
+   when complete. Otherwise, the message body is passed to the data callback
+   in fragments, followed by a call to the end callback. @complete is FALSE
+   if the port was reset or destroyed before the whole body was received.
+   The fragments reference the buffer they were read in, the data callback
+   may keep a reference to them instead of copying them. */
+typedef gboolean (*vdagent_virtio_port_begin_callback)(
+    VirtioPort *vport,
+    int port_nr,
+    VDAgentMessage *message_header);
+
+typedef void (*vdagent_virtio_port_data_callback)(
+    VirtioPort *vport,
+    int port_nr,
+    GBytes *data);
+
+typedef void (*vdagent_virtio_port_end_callback)(
+    VirtioPort *vport,
+    int port_nr,
+    gboolean complete);
+
+/* Callbacks with this type will be called once all of the messages which
+   were read at once have been passed to the read callback, callers may
+   batch up work done for the individual messages until then. */
+typedef void (*vdagent_virtio_port_messages_done_callback)(VirtioPort *vport);
+
+/* Create a vdagent virtio port object for port portname.
+
+   The port is read from @read_context, see
+   vdagent_connection_set_read_context(), all of the read, stream and
+   messages_done callbacks are invoked from it. */
 VirtioPort *vdagent_virtio_port_create(const char *portname,
+    GMainContext *read_context,
     vdagent_virtio_port_read_callback read_callback,
     VDAgentConnErrorCb error_cb);
 
-/* Queue a message for delivery, either bit by bit, or all at once */
+void vdagent_virtio_port_set_stream_callbacks(VirtioPort *vport,
+    vdagent_virtio_port_begin_callback begin_callback,
+    vdagent_virtio_port_data_callback data_callback,
+    vdagent_virtio_port_end_callback end_callback);
+
+void vdagent_virtio_port_set_messages_done_callback(VirtioPort *vport,
+    vdagent_virtio_port_messages_done_callback messages_done_callback);
+
+/* Returns a new reference to the data of the message being passed
+ * to the read callback, without copying it.
+ *
+ * Must only be called from the read callback. */
+GBytes *vdagent_virtio_port_get_message_bytes(VirtioPort *vport);
+
+/* Queue a message for delivery, either bit by bit, or all at once.
+ *
+ * The message is split into chunks of VD_AGENT_MAX_DATA_SIZE as data
+ * is appended and the chunks get queued before the whole message is
+ * appended. No other message is sent until all of @data_size is appended. */
 void vdagent_virtio_port_write_start(
         VirtioPort *vport,
         uint32_t port_nr,
@@ -68,6 +121,12 @@ void vdagent_virtio_port_write(
 
 void vdagent_virtio_port_reset(VirtioPort *vport, int port);
 
+/* Copies the number of messages and bytes either sent or received by all
+ * ports to @stats, indexed by the VD_AGENT_* message type,
+ * with VD_AGENT_END_MESSAGE entries. */
+void vdagent_virtio_port_get_message_stats(gboolean sent,
+                                           VDAgentMessageStats *stats);
+
 G_END_DECLS
 
 #endif
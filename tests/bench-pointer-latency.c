@@ -0,0 +1,466 @@
+/* bench-pointer-latency.c measures the latency of mouse input through vdagentd
+ *
+ * Copyright 2026 spice-vdagent contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The benchmark plays both the spice client, on a Unix socket which the
+ * daemon uses in place of the virtio port, and the session agent, which
+ * tells the daemon the guest resolution. The events are read back from
+ * a FIFO passed to the daemon as a fake uinput device.
+ *
+ * Every mouse state sent has a distinct x coordinate, so that the ABS_X
+ * event it results in can be matched with the time it was sent at.
+ * States the daemon coalesces don't result in an event.
+ *
+ * Usage: bench-pointer-latency [-d daemon] [-n count] [-r rate,...]
+ *                              [-- daemon options]
+ * A rate of 0 sends as fast as the daemon reads, to find its ceiling.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/input.h>
+#include <spice/vd_agent.h>
+
+#include "udscs.h"
+#include "vdagentd-proto.h"
+
+/* Width of the guest screen, every x coordinate identifies a mouse state.
+ * It matches the range of a fixed range uinput device, so that the daemon
+ * passes the coordinates unscaled with --uinput-fixed-range as well */
+#define SCREEN_WIDTH 32768
+#define SCREEN_HEIGHT 1024
+
+/* A phase ends once no event arrived for this long after the last send */
+#define DRAIN_TIMEOUT_MS 500
+
+#define DEFAULT_RATES "100,1000,10000,0"
+
+typedef struct __attribute__((packed)) {
+    VDIChunkHeader chunk;
+    VDAgentMessage message;
+    VDAgentMouseState state;
+} MouseMessage;
+
+static pid_t child_pid;
+static char tmp_dir[] = "/tmp/vdagentd-bench-XXXXXX";
+static char virtio_path[64], agent_path[64], uinput_path[64], stats_path[64];
+
+static int virtio_fd = -1;
+static int agent_fd = -1;
+static int uinput_fd = -1;
+
+/* Send time of the state with each x coordinate, 0 once matched */
+static uint64_t sent_ns[SCREEN_WIDTH];
+static uint32_t next_x = 1;
+
+static uint64_t *latencies;
+static size_t latency_count;
+
+static void cleanup(void)
+{
+    if (child_pid) {
+        kill(child_pid, SIGTERM);
+        waitpid(child_pid, NULL, 0);
+    }
+    unlink(virtio_path);
+    unlink(agent_path);
+    unlink(uinput_path);
+    unlink(stats_path);
+    rmdir(tmp_dir);
+}
+
+static void check(int line, const char *cond_str, int cond_value)
+{
+    if (!cond_value) {
+        fprintf(stderr, "%d: Check %s failed: %s\n", line, cond_str,
+                strerror(errno));
+        exit(1);
+    }
+}
+#define check(cond) check(__LINE__, #cond, cond)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void make_path(char *path, size_t size, const char *name)
+{
+    snprintf(path, size, "%s/%s", tmp_dir, name);
+}
+
+static void write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (size > 0) {
+        n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        check(n > 0);
+        p += n;
+        size -= n;
+    }
+}
+
+/* Reads and drops whatever the daemon sends on @fd */
+static void drain(int fd)
+{
+    char buf[4096];
+    ssize_t n;
+
+    n = read(fd, buf, sizeof(buf));
+    check(n > 0 || (n < 0 && errno == EAGAIN));
+}
+
+static void launch_daemon(const char *daemon, int argc, char **argv)
+{
+    char **args = calloc(argc + 16, sizeof(char *));
+    int i, n = 0;
+
+    check(args != NULL);
+    args[n++] = "spice-vdagentd";
+    args[n++] = "-x";
+    args[n++] = "-f";
+    args[n++] = "-s";
+    args[n++] = virtio_path;
+    args[n++] = "-S";
+    args[n++] = agent_path;
+    args[n++] = "-u";
+    args[n++] = uinput_path;
+#if defined(HAVE_CONSOLE_KIT) || defined(HAVE_LIBSYSTEMD_LOGIN)
+    args[n++] = "-X";
+#endif
+    for (i = 0; i < argc; i++) {
+        args[n++] = argv[i];
+    }
+
+    child_pid = fork();
+    check(child_pid != -1);
+    if (child_pid == 0) {
+        execv(daemon, args);
+        fprintf(stderr, "Error launching %s: %s\n", daemon, strerror(errno));
+        _exit(1);
+    }
+    free(args);
+}
+
+/* The daemon creates the agent socket once it's ready */
+static int connect_agent(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd, tries;
+
+    strncpy(addr.sun_path, agent_path, sizeof(addr.sun_path) - 1);
+    for (tries = 0; tries < 500; tries++) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        check(fd != -1);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    check(!"the daemon didn't create its socket");
+    return -1;
+}
+
+/* Once the agent reports a resolution, the daemon opens the virtio port */
+static void send_resolution(void)
+{
+    struct {
+        struct udscs_message_header header;
+        struct vdagentd_guest_xorg_resolution res;
+    } msg = {
+        .header = {
+            .type = VDAGENTD_GUEST_XORG_RESOLUTION,
+            .arg1 = SCREEN_WIDTH,
+            .arg2 = SCREEN_HEIGHT,
+            .size = sizeof(struct vdagentd_guest_xorg_resolution),
+        },
+        .res = {
+            .width = SCREEN_WIDTH,
+            .height = SCREEN_HEIGHT,
+        },
+    };
+
+    write_all(agent_fd, &msg, sizeof(msg));
+}
+
+static int accept_virtio(int listen_fd)
+{
+    struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+    int fd;
+
+    check(poll(&pfd, 1, 5000) == 1);
+    fd = accept(listen_fd, NULL, NULL);
+    check(fd != -1);
+    return fd;
+}
+
+static void send_mouse_state(void)
+{
+    MouseMessage msg = {
+        .chunk = {
+            .port = htole32(VDP_CLIENT_PORT),
+            .size = htole32(sizeof(VDAgentMessage) + sizeof(VDAgentMouseState)),
+        },
+        .message = {
+            .protocol = htole32(VD_AGENT_PROTOCOL),
+            .type = htole32(VD_AGENT_MOUSE_STATE),
+            .size = htole32(sizeof(VDAgentMouseState)),
+        },
+        .state = {
+            .x = htole32(next_x),
+        },
+    };
+
+    sent_ns[next_x] = now_ns();
+    write_all(virtio_fd, &msg, sizeof(msg));
+    /* x 0 is skipped, it's where the pointer starts */
+    next_x = next_x + 1 < SCREEN_WIDTH ? next_x + 1 : 1;
+}
+
+/* Returns the number of states matched with an event */
+static size_t read_events(void)
+{
+    struct input_event events[64];
+    size_t i, matched = 0;
+    uint64_t now;
+    ssize_t n;
+
+    n = read(uinput_fd, events, sizeof(events));
+    if (n < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    check(n > 0 && n % sizeof(struct input_event) == 0);
+
+    now = now_ns();
+    for (i = 0; i < n / sizeof(struct input_event); i++) {
+        uint32_t x = events[i].value;
+
+        if (events[i].type != EV_ABS || events[i].code != ABS_X ||
+            x >= SCREEN_WIDTH || sent_ns[x] == 0) {
+            continue;
+        }
+        latencies[latency_count++] = now - sent_ns[x];
+        sent_ns[x] = 0;
+        matched++;
+    }
+    return matched;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(double p)
+{
+    size_t i = (size_t)(p * (latency_count - 1));
+
+    return latencies[i] / 1000.0;
+}
+
+static void run_phase(unsigned rate, unsigned count)
+{
+    struct pollfd pfds[3] = {
+        { .fd = uinput_fd, .events = POLLIN },
+        { .fd = virtio_fd, .events = POLLIN },
+        { .fd = agent_fd,  .events = POLLIN },
+    };
+    uint64_t interval = rate ? 1000000000ull / rate : 0;
+    uint64_t start, next, last_event, end = 0;
+    unsigned sent = 0;
+    size_t delivered = 0;
+    int writable = 1, timeout;
+    char rate_str[16];
+    double elapsed;
+
+    memset(sent_ns, 0, sizeof(sent_ns));
+    latency_count = 0;
+
+    start = next = last_event = now_ns();
+    for (;;) {
+        uint64_t now = now_ns();
+
+        /* without a rate, states are sent whenever the socket is writable */
+        if (sent < count && (rate ? now >= next : writable)) {
+            send_mouse_state();
+            sent++;
+            next += interval;
+            if (sent == count) {
+                end = last_event = now_ns();
+            }
+        }
+
+        if (sent < count) {
+            pfds[1].events = rate ? POLLIN : POLLIN | POLLOUT;
+            if (rate == 0) {
+                timeout = -1;
+            } else {
+                timeout = next > now ? (next - now) / 1000000 : 0;
+            }
+        } else {
+            uint64_t idle = (now_ns() - last_event) / 1000000;
+
+            if (idle >= DRAIN_TIMEOUT_MS || delivered == sent) {
+                break;
+            }
+            pfds[1].events = POLLIN;
+            timeout = DRAIN_TIMEOUT_MS - idle;
+        }
+
+        check(poll(pfds, 3, timeout) >= 0);
+        check(!(pfds[0].revents & POLLHUP) && !(pfds[1].revents & POLLHUP));
+        if (pfds[0].revents & POLLIN) {
+            size_t matched = read_events();
+            if (matched) {
+                delivered += matched;
+                last_event = now_ns();
+            }
+        }
+        if (pfds[1].revents & POLLIN) {
+            drain(virtio_fd);
+        }
+        if (pfds[2].revents & POLLIN) {
+            drain(agent_fd);
+        }
+        writable = pfds[1].revents & POLLOUT;
+    }
+
+    elapsed = (end - start) / 1e9;
+    qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+    if (rate) {
+        snprintf(rate_str, sizeof(rate_str), "%u", rate);
+    } else {
+        snprintf(rate_str, sizeof(rate_str), "max");
+    }
+    printf("%8s %8u %9zu %10.0f %10.0f", rate_str, sent, delivered,
+           sent / elapsed, delivered / elapsed);
+    if (latency_count) {
+        printf(" %9.1f %9.1f %9.1f\n", percentile_us(0.5),
+               percentile_us(0.99), latencies[latency_count - 1] / 1000.0);
+    } else {
+        printf(" %9s %9s %9s\n", "-", "-", "-");
+    }
+    fflush(stdout);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-d daemon] [-n count] [-r rate,...] [-- daemon options]\n"
+            "  -d daemon   spice-vdagentd to run (src/spice-vdagentd)\n"
+            "  -n count    mouse states to send at each rate (10000)\n"
+            "  -r rates    comma separated states per second, 0 sends as fast\n"
+            "              as the daemon reads (" DEFAULT_RATES ")\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    const char *daemon = "src/spice-vdagentd";
+    char *rates = strdup(DEFAULT_RATES), *rate, *saveptr;
+    unsigned count = 10000;
+    int listen_fd, opt;
+
+    while ((opt = getopt(argc, argv, "d:n:r:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            daemon = optarg;
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            free(rates);
+            rates = strdup(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (count == 0) {
+        usage(argv[0]);
+    }
+
+    latencies = calloc(count, sizeof(uint64_t));
+    check(latencies != NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    check(mkdtemp(tmp_dir) != NULL);
+    atexit(cleanup);
+    make_path(virtio_path, sizeof(virtio_path), "virtio");
+    make_path(agent_path, sizeof(agent_path), "agent");
+    make_path(uinput_path, sizeof(uinput_path), "uinput");
+    /* created by the daemon next to the agent socket */
+    make_path(stats_path, sizeof(stats_path), "agent-stats");
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    check(listen_fd != -1);
+    strncpy(addr.sun_path, virtio_path, sizeof(addr.sun_path) - 1);
+    check(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    check(listen(listen_fd, 1) == 0);
+
+    /* opened first, so that the daemon doesn't block opening the FIFO */
+    check(mkfifo(uinput_path, 0600) == 0);
+    uinput_fd = open(uinput_path, O_RDONLY | O_NONBLOCK);
+    check(uinput_fd != -1);
+
+    launch_daemon(daemon, argc - optind, argv + optind);
+    agent_fd = connect_agent();
+    check(fcntl(agent_fd, F_SETFL, O_NONBLOCK) == 0);
+    send_resolution();
+    virtio_fd = accept_virtio(listen_fd);
+    close(listen_fd);
+
+    printf("%8s %8s %9s %10s %10s %9s %9s %9s\n", "rate", "sent",
+           "delivered", "sent/s", "events/s", "p50(us)", "p99(us)", "max(us)");
+    for (rate = strtok_r(rates, ",", &saveptr); rate;
+         rate = strtok_r(NULL, ",", &saveptr)) {
+        run_phase(strtoul(rate, NULL, 10), count);
+    }
+
+    free(rates);
+    free(latencies);
+    return 0;
+}
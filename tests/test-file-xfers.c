@@ -23,11 +23,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <glib.h>
 
 #include <spice/vd_agent.h>
 
 #include "file-xfers.h"
+#include "vdagentd-proto.h"
+
+#define CANCEL_XFER_ID 1
+#define CANCEL_DATA_MESSAGES 16
+#define CANCEL_DATA_SIZE 4096
 
 static void test_file(const char *file_name, const char *out)
 {
@@ -44,6 +51,134 @@ static void test_file(const char *file_name, const char *out)
     g_free(fn);
 }
 
+static void connection_error(VDAgentConnection *conn, GError *err)
+{
+    g_error("connection error: %s", err ? err->message : "disconnected");
+}
+
+static void read_all(int fd, void *buf, size_t size)
+{
+    ssize_t n;
+
+    while (size > 0) {
+        n = read(fd, buf, size);
+        g_assert_cmpint(n, >, 0);
+        buf = (uint8_t *)buf + n;
+        size -= n;
+    }
+}
+
+/* Connects a udscs client to a socket the test accepts on,
+ * the accepted FD is returned in @peer_fd */
+static UdscsConnection *connect_pair(int listen_fd, const char *path,
+                                     int *peer_fd)
+{
+    UdscsConnection *conn;
+    GError *err = NULL;
+
+    conn = udscs_connect(path, NULL, connection_error, 0, &err);
+    g_assert_no_error(err);
+    *peer_fd = accept(listen_fd, NULL, NULL);
+    g_assert_cmpint(*peer_fd, !=, -1);
+    return conn;
+}
+
+/* The daemon queues the data of a transfer before the client cancels it,
+ * the agent must see the data before the cancel, and then drop the file */
+static void test_cancel(void)
+{
+    static const char path[] = "./test-dir/sock";
+    static const char start_data[] =
+        "[vdagent-file-xfer]\nname=cancel.txt\nsize=1048576\n";
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    UdscsConnection *daemon_conn, *reply_conn;
+    struct vdagent_file_xfers *xfers;
+    VDAgentFileXferStartMessage *start;
+    VDAgentFileXferDataMessage *data;
+    VDAgentFileXferStatusMessage status = {
+        .id = CANCEL_XFER_ID,
+        .result = VD_AGENT_FILE_XFER_STATUS_CANCELLED,
+    };
+    struct udscs_message_header header;
+    int listen_fd, agent_fd, reply_fd, i, data_received = 0;
+    gboolean cancelled = FALSE;
+    GBytes *bytes;
+    uint8_t *buf;
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    g_assert_cmpint(listen_fd, !=, -1);
+    strcpy(addr.sun_path, path);
+    g_assert_cmpint(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+    g_assert_cmpint(listen(listen_fd, 2), ==, 0);
+
+    daemon_conn = connect_pair(listen_fd, path, &agent_fd);
+    /* replies of the agent to the daemon, not checked */
+    reply_conn = connect_pair(listen_fd, path, &reply_fd);
+    xfers = vdagent_file_xfers_create(reply_conn, "./test-dir", 0, 0);
+
+    /* queue the messages as the daemon does */
+    start = g_malloc(sizeof(*start) + sizeof(start_data));
+    start->id = CANCEL_XFER_ID;
+    memcpy(start->data, start_data, sizeof(start_data));
+    bytes = g_bytes_new_take(start, sizeof(*start) + sizeof(start_data));
+    udscs_write_bytes(daemon_conn, VDAGENTD_FILE_XFER_START, 0, 0, bytes);
+    g_bytes_unref(bytes);
+
+    for (i = 0; i < CANCEL_DATA_MESSAGES; i++) {
+        data = g_malloc0(sizeof(*data) + CANCEL_DATA_SIZE);
+        data->id = CANCEL_XFER_ID;
+        data->size = CANCEL_DATA_SIZE;
+        bytes = g_bytes_new_take(data, sizeof(*data) + CANCEL_DATA_SIZE);
+        udscs_write_bytes(daemon_conn, VDAGENTD_FILE_XFER_DATA, 0, 0, bytes);
+        g_bytes_unref(bytes);
+    }
+
+    bytes = g_bytes_new(&status, sizeof(status));
+    udscs_write_bytes(daemon_conn, VDAGENTD_FILE_XFER_STATUS, 0, 0, bytes);
+    g_bytes_unref(bytes);
+    vdagent_connection_flush(VDAGENT_CONNECTION(daemon_conn));
+
+    /* play the agent */
+    for (i = 0; i < CANCEL_DATA_MESSAGES + 2; i++) {
+        read_all(agent_fd, &header, sizeof(header));
+        buf = g_malloc(header.size);
+        read_all(agent_fd, buf, header.size);
+
+        switch (header.type) {
+        case VDAGENTD_FILE_XFER_START:
+            g_assert_cmpint(i, ==, 0);
+            vdagent_file_xfers_start(xfers, (VDAgentFileXferStartMessage *)buf);
+            g_assert_cmpint(access("./test-dir/cancel.txt", F_OK), ==, 0);
+            break;
+        case VDAGENTD_FILE_XFER_DATA:
+            g_assert_false(cancelled);
+            vdagent_file_xfers_data(xfers, (VDAgentFileXferDataMessage *)buf);
+            data_received++;
+            break;
+        case VDAGENTD_FILE_XFER_STATUS:
+            cancelled = TRUE;
+            vdagent_file_xfers_status(xfers, (VDAgentFileXferStatusMessage *)buf);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        g_free(buf);
+    }
+    g_assert_true(cancelled);
+    g_assert_cmpint(data_received, ==, CANCEL_DATA_MESSAGES);
+
+    /* the partially received file is removed */
+    g_assert_cmpint(access("./test-dir/cancel.txt", F_OK), ==, -1);
+
+    vdagent_file_xfers_destroy(xfers);
+    vdagent_connection_destroy(daemon_conn);
+    vdagent_connection_destroy(reply_conn);
+    close(agent_fd);
+    close(reply_fd);
+    close(listen_fd);
+    unlink(path);
+}
+
 int main(int argc, char *argv[])
 {
     assert(system("rm -rf test-dir && mkdir test-dir") == 0);
@@ -77,6 +212,9 @@ int main(int argc, char *argv[])
     // create a file with same name above, should not strip the filename
     test_file("sub.dir/test", "./test-dir/sub.dir/test (1)");
 
+    // cancel a transfer while its data is queued
+    test_cancel();
+
     assert(system("rm -rf test-dir") == 0);
 
     return 0;
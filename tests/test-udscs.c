@@ -0,0 +1,147 @@
+/*  test-udscs.c  - test messages streamed through udscs
+
+    Copyright 2026 spice-vdagent contributors
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <spice/vd_agent.h>
+
+#include "udscs.h"
+#include "vdagentd-proto.h"
+
+#define CLIPBOARD_SIZE 8192
+#define FRAGMENT_SIZE 4096
+
+static void connection_error(VDAgentConnection *conn, GError *err)
+{
+    g_error("connection error: %s", err ? err->message : "disconnected");
+}
+
+static void read_all(int fd, void *buf, size_t size)
+{
+    ssize_t n;
+
+    while (size > 0) {
+        n = read(fd, buf, size);
+        g_assert_cmpint(n, >, 0);
+        buf = (uint8_t *)buf + n;
+        size -= n;
+    }
+}
+
+static void append_fragment(UdscsConnection *conn, uint8_t value)
+{
+    GBytes *bytes;
+    uint8_t *data;
+
+    data = g_malloc(FRAGMENT_SIZE);
+    memset(data, value, FRAGMENT_SIZE);
+    bytes = g_bytes_new_take(data, FRAGMENT_SIZE);
+    udscs_write_append_bytes(conn, bytes);
+    g_bytes_unref(bytes);
+}
+
+/* A clipboard message cut off by the client must never reach the agent,
+ * and messages sent while it's received must not wait for it */
+static void test_cut_off_clipboard(int listen_fd, const char *path)
+{
+    struct udscs_message_header header;
+    UdscsConnection *conn;
+    GError *err = NULL;
+    uint8_t *data;
+    int peer_fd, i;
+
+    conn = udscs_connect(path, NULL, connection_error, 0, &err);
+    g_assert_no_error(err);
+    peer_fd = accept(listen_fd, NULL, NULL);
+    g_assert_cmpint(peer_fd, !=, -1);
+
+    /* cut off after its first fragment */
+    udscs_write_start(conn, VDAGENTD_CLIPBOARD_DATA,
+                      VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD,
+                      VD_AGENT_CLIPBOARD_UTF8_TEXT, CLIPBOARD_SIZE);
+    append_fragment(conn, 0xaa);
+    udscs_write(conn, VDAGENTD_CLIENT_DISCONNECTED, 0, 0, NULL, 0);
+    udscs_write_end(conn);
+
+    /* received in full */
+    udscs_write_start(conn, VDAGENTD_CLIPBOARD_DATA,
+                      VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD,
+                      VD_AGENT_CLIPBOARD_UTF8_TEXT, CLIPBOARD_SIZE);
+    append_fragment(conn, 0x11);
+    append_fragment(conn, 0x22);
+    udscs_write_end(conn);
+
+    vdagent_connection_flush(VDAGENT_CONNECTION(conn));
+
+    read_all(peer_fd, &header, sizeof(header));
+    g_assert_cmpuint(header.type, ==, VDAGENTD_CLIENT_DISCONNECTED);
+    g_assert_cmpuint(header.size, ==, 0);
+
+    read_all(peer_fd, &header, sizeof(header));
+    g_assert_cmpuint(header.type, ==, VDAGENTD_CLIPBOARD_DATA);
+    g_assert_cmpuint(header.size, ==, CLIPBOARD_SIZE);
+    data = g_malloc(CLIPBOARD_SIZE);
+    read_all(peer_fd, data, CLIPBOARD_SIZE);
+    for (i = 0; i < CLIPBOARD_SIZE; i++) {
+        g_assert_cmpuint(data[i], ==, i < FRAGMENT_SIZE ? 0x11 : 0x22);
+    }
+    g_free(data);
+
+    /* nothing else, no padded leftover of the first message */
+    g_assert_cmpint(fcntl(peer_fd, F_SETFL, O_NONBLOCK), ==, 0);
+    g_assert_cmpint(read(peer_fd, &header, sizeof(header)), ==, -1);
+    g_assert_cmpint(errno, ==, EAGAIN);
+
+    vdagent_connection_destroy(conn);
+    close(peer_fd);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    gchar *dir, *path;
+    int listen_fd;
+
+    dir = g_dir_make_tmp("test-udscs-XXXXXX", NULL);
+    g_assert_nonnull(dir);
+    path = g_build_filename(dir, "sock", NULL);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    g_assert_cmpint(listen_fd, !=, -1);
+    g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+    g_assert_cmpint(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+    g_assert_cmpint(listen(listen_fd, 1), ==, 0);
+
+    test_cut_off_clipboard(listen_fd, path);
+
+    close(listen_fd);
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+    return 0;
+}